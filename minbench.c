@@ -0,0 +1,385 @@
+/*
+ * minbench.c
+ *   Benchmark harness for libminixfs.  Generates a synthetic MINIX
+ *   image with deliberately awkward shapes — a deep directory chain,
+ *   a huge flat directory, a sparse file, and a double-indirect-heavy
+ *   file — then times fs_find_path, fs_list_dir, and
+ *   fs_copy_file_to_stream over it.  Run via "make bench".
+ *
+ *   The image is rebuilt on every run (it is small and cheap) so the
+ *   numbers are always measured against a known layout.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "minix_fs.h"
+
+#define B_BS          1024        /* blocksize and zonesize */
+#define B_NZONES      3072
+#define B_NINODES     64
+#define B_ITAB_BLOCK  4           /* 2 + i_blocks(1) + z_blocks(1) */
+#define B_FIRST_ZONE  8           /* inode table is 4 blocks */
+#define B_PTRS        (B_BS / 4)  /* zone pointers per indirect block */
+
+#define B_FLAT_ENTRIES 2000       /* names in the flat directory */
+#define B_DEEP_DEPTH   40         /* directories in the deep chain */
+#define B_BIG_ZONES    2048       /* 2 MB file: well into double indirect */
+
+#define B_FIND_ITERS   2000
+#define B_IMAGE_PATH   "/tmp/minbench.img"
+
+static unsigned char *img;
+static uint32_t next_zone = B_FIRST_ZONE;
+static uint32_t next_ino = 2;     /* 1 is the root */
+
+
+static void *
+zptr(uint32_t z)
+{
+    return img + (size_t)z * B_BS;
+}
+
+static uint32_t
+zalloc(void)
+{
+    if (next_zone >= B_NZONES) {
+        fprintf(stderr, "minbench: image too small\n");
+        exit(EXIT_FAILURE);
+    }
+    return next_zone++;
+}
+
+static uint32_t
+ialloc(void)
+{
+    if (next_ino > B_NINODES) {
+        fprintf(stderr, "minbench: out of inodes\n");
+        exit(EXIT_FAILURE);
+    }
+    return next_ino++;
+}
+
+static struct inode *
+iptr(uint32_t inum)
+{
+    return (struct inode *)(img + (size_t)B_ITAB_BLOCK * B_BS
+                            + (size_t)(inum - 1) * 64);
+}
+
+/*
+ * store_blob:
+ *   Lay 'size' bytes of file or directory data into freshly allocated
+ *   zones and wire up the inode, spilling into single- and
+ *   double-indirect blocks exactly as a real filesystem would.
+ */
+static void
+store_blob(uint32_t inum, uint16_t mode, const unsigned char *data,
+           uint32_t size)
+{
+    struct inode *ino = iptr(inum);
+    uint32_t nzones = (size + B_BS - 1) / B_BS;
+    uint32_t ind = 0;
+    uint32_t dbl = 0;
+    uint32_t l2 = 0;
+    uint32_t i;
+
+    memset(ino, 0, sizeof(*ino));
+    ino->mode = mode;
+    ino->links = 1;
+    ino->size = size;
+
+    for (i = 0; i < nzones; i++) {
+        uint32_t z = zalloc();
+        uint32_t chunk = (size - i * B_BS < B_BS) ? size - i * B_BS : B_BS;
+
+        memcpy(zptr(z), data + (size_t)i * B_BS, chunk);
+
+        if (i < DIRECT_ZONES) {
+            ino->zone[i] = z;
+        }
+        else if (i < DIRECT_ZONES + B_PTRS) {
+            if (ind == 0) {
+                ind = zalloc();
+                ino->indirect = ind;
+            }
+            ((uint32_t *)zptr(ind))[i - DIRECT_ZONES] = z;
+        }
+        else {
+            uint32_t idx = i - DIRECT_ZONES - B_PTRS;
+
+            if (dbl == 0) {
+                dbl = zalloc();
+                ino->two_indirect = dbl;
+            }
+            if (idx % B_PTRS == 0) {
+                l2 = zalloc();
+                ((uint32_t *)zptr(dbl))[idx / B_PTRS] = l2;
+            }
+            ((uint32_t *)zptr(l2))[idx % B_PTRS] = z;
+        }
+    }
+}
+
+static void
+add_dirent(unsigned char *buf, uint32_t slot, uint32_t inum,
+           const char *name)
+{
+    struct dirent *de = (struct dirent *)(buf + (size_t)slot
+                                          * DIR_ENTRY_SIZE);
+
+    memset(de, 0, DIR_ENTRY_SIZE);
+    de->inode = inum;
+    strcpy((char *)de->name, name);
+}
+
+/*
+ * build_image:
+ *   Assemble the synthetic image in memory and write it to path.
+ *   Returns the inode number of the big file (for the copy bench).
+ */
+static void
+build_image(const char *path)
+{
+    unsigned char *blob;
+    unsigned char *big;
+    uint32_t flat_ino, target_ino, prev, i;
+    char name[64];
+    struct superblock *sb;
+    FILE *fp;
+
+    img = calloc(B_NZONES, B_BS);
+    if (!img) {
+        fprintf(stderr, "minbench: calloc image\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Superblock. */
+    sb = (struct superblock *)(img + 1024);
+    sb->ninodes = B_NINODES;
+    sb->i_blocks = 1;
+    sb->z_blocks = 1;
+    sb->firstdata = B_FIRST_ZONE;
+    sb->log_zone_size = 0;
+    sb->max_file = 0x7fffffff;
+    sb->zones = B_NZONES;
+    sb->magic = (int16_t)MINIX_MAGIC;
+    sb->blocksize = B_BS;
+
+    /* Small target file every flat-directory name links to. */
+    target_ino = ialloc();
+    store_blob(target_ino, 0100644, (const unsigned char *)"bench\n", 6);
+
+    /* Huge flat directory. */
+    flat_ino = ialloc();
+    blob = calloc(B_FLAT_ENTRIES + 2, DIR_ENTRY_SIZE);
+    add_dirent(blob, 0, flat_ino, ".");
+    add_dirent(blob, 1, 1, "..");
+    for (i = 0; i < B_FLAT_ENTRIES; i++) {
+        sprintf(name, "f%05u", i);
+        add_dirent(blob, i + 2, target_ino, name);
+    }
+    store_blob(flat_ino, 040755, blob,
+               (B_FLAT_ENTRIES + 2) * DIR_ENTRY_SIZE);
+    free(blob);
+
+    /* Deep chain d000/d001/.../leaf, built bottom-up. */
+    prev = ialloc();
+    store_blob(prev, 0100644, (const unsigned char *)"deep\n", 5);
+    blob = calloc(3, DIR_ENTRY_SIZE);
+    for (i = B_DEEP_DEPTH; i > 0; i--) {
+        uint32_t dino = ialloc();
+
+        add_dirent(blob, 0, dino, ".");
+        add_dirent(blob, 1, 1, "..");   /* parent link is unused here */
+        if (i == B_DEEP_DEPTH) {
+            add_dirent(blob, 2, prev, "leaf");
+        }
+        else {
+            sprintf(name, "d%03u", i);
+            add_dirent(blob, 2, prev, name);
+        }
+        store_blob(dino, 040755, blob, 3 * DIR_ENTRY_SIZE);
+        prev = dino;
+    }
+    free(blob);
+
+    /* Big file: patterned data far into the double-indirect range. */
+    big = malloc((size_t)B_BIG_ZONES * B_BS);
+    for (i = 0; i < (uint32_t)B_BIG_ZONES * B_BS; i++) {
+        big[i] = (unsigned char)i;
+    }
+    store_blob(ialloc(), 0100644, big, B_BIG_ZONES * B_BS);
+    free(big);
+
+    /* Sparse file: single allocated zone between two holes. */
+    {
+        uint32_t sino = ialloc();
+        struct inode *ino = iptr(sino);
+        uint32_t z = zalloc();
+
+        memset(ino, 0, sizeof(*ino));
+        ino->mode = 0100644;
+        ino->links = 1;
+        ino->size = 3 * B_BS;
+        ino->zone[1] = z;
+        memset(zptr(z), 0x55, B_BS);
+
+        /* Root directory, now that every inode number is known. */
+        blob = calloc(7, DIR_ENTRY_SIZE);
+        add_dirent(blob, 0, 1, ".");
+        add_dirent(blob, 1, 1, "..");
+        add_dirent(blob, 2, flat_ino, "flat");
+        add_dirent(blob, 3, prev, "d000");
+        add_dirent(blob, 4, sino - 1, "big.bin");
+        add_dirent(blob, 5, sino, "sparse.bin");
+        store_blob(1, 040755, blob, 6 * DIR_ENTRY_SIZE);
+        free(blob);
+    }
+
+    /* Allocation bitmaps (blocks 2 and 3): bit 0 of each is
+     * reserved; inode bit i covers inode i, zone bit n covers zone
+     * firstdata + n - 1.  Allocation above was strictly sequential,
+     * so the used ranges are contiguous. */
+    {
+        unsigned char *imap = img + 2 * B_BS;
+        unsigned char *zmap = img + 3 * B_BS;
+
+        for (i = 0; i < next_ino; i++) {
+            imap[i >> 3] |= (unsigned char)(1 << (i & 7));
+        }
+        for (i = 0; i <= next_zone - B_FIRST_ZONE; i++) {
+            zmap[i >> 3] |= (unsigned char)(1 << (i & 7));
+        }
+    }
+
+    fp = fopen(path, "wb");
+    if (!fp || fwrite(img, B_BS, B_NZONES, fp) != B_NZONES) {
+        perror("write bench image");
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+    free(img);
+    img = NULL;
+}
+
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    const char *path = (argc > 1) ? argv[1] : B_IMAGE_PATH;
+    struct options opt;
+    struct fs fs;
+    struct inode ino;
+    uint32_t inum;
+    char deep[1024];
+    char lookup[64];
+    double t0, t1;
+    uint32_t i;
+    FILE *fp;
+    FILE *devnull;
+
+    build_image(path);
+
+    memset(&opt, 0, sizeof(opt));
+    opt.cache_mb = 4;
+    opt.jobs = 1;
+
+    fp = fopen(path, "rb");
+    if (!fp || fs_init(&fs, fp, &opt, 0) < 0) {
+        fprintf(stderr, "minbench: cannot open %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    /* 1. Deep path resolution. */
+    strcpy(deep, "/d000");
+    for (i = 1; i < B_DEEP_DEPTH; i++) {
+        sprintf(deep + strlen(deep), "/d%03u", i);
+    }
+    strcat(deep, "/leaf");
+    t0 = now();
+    for (i = 0; i < B_FIND_ITERS; i++) {
+        if (fs_find_path(&fs, deep, &ino, &inum) < 0) {
+            fprintf(stderr, "minbench: deep lookup failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    t1 = now();
+    printf("find deep (%u levels) : %8.1f lookups/s\n",
+           B_DEEP_DEPTH, B_FIND_ITERS / (t1 - t0));
+
+    /* 2. Flat directory resolution (exercises the directory hash). */
+    t0 = now();
+    for (i = 0; i < B_FLAT_ENTRIES; i++) {
+        sprintf(lookup, "/flat/f%05u", i);
+        if (fs_find_path(&fs, lookup, &ino, &inum) < 0) {
+            fprintf(stderr, "minbench: flat lookup failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    t1 = now();
+    printf("find flat (%u names)  : %8.1f lookups/s\n",
+           B_FLAT_ENTRIES, B_FLAT_ENTRIES / (t1 - t0));
+
+    /* 3. Flat directory listing (output discarded). */
+    devnull = fopen("/dev/null", "w");
+    if (fs_find_path(&fs, "/flat", &ino, &inum) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    fflush(stdout);
+    {
+        int saved = dup(STDOUT_FILENO);
+
+        dup2(fileno(devnull), STDOUT_FILENO);
+        t0 = now();
+        fs_list_dir(&fs, "/flat", &ino);
+        fflush(stdout);
+        t1 = now();
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+    printf("list flat (%u names)  : %8.1f entries/s\n",
+           B_FLAT_ENTRIES, (B_FLAT_ENTRIES + 2) / (t1 - t0));
+
+    /* 4. Big-file copy (double-indirect heavy). */
+    if (fs_find_path(&fs, "/big.bin", &ino, &inum) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    t0 = now();
+    if (fs_copy_file_to_stream(&fs, &ino, devnull) < 0) {
+        fprintf(stderr, "minbench: copy failed\n");
+        exit(EXIT_FAILURE);
+    }
+    fflush(devnull);
+    t1 = now();
+    printf("copy big (%u KB)     : %8.1f MB/s\n",
+           (unsigned)(B_BIG_ZONES * B_BS / 1024),
+           (double)B_BIG_ZONES * B_BS / (1024.0 * 1024.0) / (t1 - t0));
+
+    /* 5. Sparse copy correctness + speed in one shot. */
+    if (fs_find_path(&fs, "/sparse.bin", &ino, &inum) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    t0 = now();
+    fs_copy_file_to_stream(&fs, &ino, devnull);
+    t1 = now();
+    printf("copy sparse           : %8.3f ms\n", (t1 - t0) * 1000.0);
+
+    fclose(devnull);
+    fs_destroy(&fs);
+    return 0;
+}
@@ -1,15 +1,35 @@
+#define _XOPEN_SOURCE 600   /* for mkdir/pread/pthreads with -ansi */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "minix_fs.h"
 
-/* 
+/*
  * minget: copy a regular file out of a MINIX filesystem image.
  * Usage: minget [ -v ] [ -p num [ -s num ] ] imagefile srcpath [ dstpath ]
  * Opens the image, finds srcpath, verifies it is a regular file, and
  * copies its contents to dstpath or stdout.
+ * Batch mode (-B listfile imagefile outdir) extracts every path named
+ * in listfile in one pass over the image.
  */
 
+static int copy_range(const struct fs *fs, const char *srcpath,
+                      FILE *out, long off, long len, uint32_t *crc);
+static int tar_stream(struct fs *fs, const char *path, FILE *out,
+                      int verbose);
+static int extract_all(struct fs *fs, const char *imagefile,
+                       const char *outdir, int jobs, int checksum,
+                       int verbose);
+static int batch_extract(struct fs *fs, const char *imagefile,
+                         const char *listfile, const char *outdir,
+                         int jobs, int checksum, int verbose);
+
 int
 main(int argc, char **argv)
 {
@@ -28,6 +48,104 @@ main(int argc, char **argv)
    parse_common_options(argc, argv, &opt, 1, &rest);
 
 
+   if (opt.extract_all) {
+       /* Extract-all mode: minget -a imagefile outdir */
+       int rc;
+
+       if (!rest[0] || !rest[1]) {
+           fprintf(stderr,
+               "usage: minget [ -v ] [ -p num [ -s num ] ] "
+               "-a imagefile outdir\n");
+           exit(EXIT_FAILURE);
+       }
+
+       fp = fopen(rest[0], "rb");
+       if (!fp) {
+           perror("fopen imagefile");
+           exit(EXIT_FAILURE);
+       }
+       if (fs_init(&fs, fp, &opt, opt.verbose) < 0) {
+           fs_destroy(&fs);
+           exit(EXIT_FAILURE);
+       }
+
+       fs_load_inode_table(&fs);
+
+       rc = extract_all(&fs, rest[0], rest[1], opt.jobs,
+                        opt.checksum, opt.verbose);
+       if (opt.show_stats) {
+           fs_print_stats(&fs);
+       }
+       fs_destroy(&fs);
+       return (rc < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+   }
+
+
+   if (opt.batchfile) {
+       /* Batch mode: minget -B listfile imagefile outdir */
+       int rc;
+
+       if (!rest[0] || !rest[1]) {
+           fprintf(stderr,
+               "usage: minget [ -v ] [ -p num [ -s num ] ] "
+               "-B listfile imagefile outdir\n");
+           exit(EXIT_FAILURE);
+       }
+
+       fp = fopen(rest[0], "rb");
+       if (!fp) {
+           perror("fopen imagefile");
+           exit(EXIT_FAILURE);
+       }
+       if (fs_init(&fs, fp, &opt, opt.verbose) < 0) {
+           fs_destroy(&fs);
+           exit(EXIT_FAILURE);
+       }
+
+       fs_index_load(&fs, rest[0]);
+       fs_load_inode_table(&fs);
+
+       rc = batch_extract(&fs, rest[0], opt.batchfile, rest[1],
+                          opt.jobs, opt.checksum, opt.verbose);
+       if (opt.show_stats) {
+           fs_print_stats(&fs);
+       }
+       fs_destroy(&fs);
+       return (rc < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+   }
+
+
+   if (opt.tar) {
+       /* Tar mode: minget -t imagefile [path] > out.tar */
+       int rc;
+
+       if (!rest[0]) {
+           fprintf(stderr,
+               "usage: minget [ -v ] [ -p num [ -s num ] ] "
+               "-t imagefile [ path ]\n");
+           exit(EXIT_FAILURE);
+       }
+
+       fp = fopen(rest[0], "rb");
+       if (!fp) {
+           perror("fopen imagefile");
+           exit(EXIT_FAILURE);
+       }
+       if (fs_init(&fs, fp, &opt, opt.verbose) < 0) {
+           fs_destroy(&fs);
+           exit(EXIT_FAILURE);
+       }
+
+       rc = tar_stream(&fs, rest[1] ? rest[1] : "/", stdout,
+                       opt.verbose);
+       if (opt.show_stats) {
+           fs_print_stats(&fs);
+       }
+       fs_destroy(&fs);
+       return (rc < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+   }
+
+
    if (!rest[0] || !rest[1]) {
        fprintf(stderr,
            "usage: minget [ -v ] [ -p num [ -s num ] ] imagefile "
@@ -53,13 +171,16 @@ main(int argc, char **argv)
 
 
    if (fs_init(&fs, fp, &opt, opt.verbose) < 0) {
-       fclose(fp);
+       fs_destroy(&fs);
        exit(EXIT_FAILURE);
    }
 
 
+   fs_index_load(&fs, imagefile);
+
+
    if (fs_find_path(&fs, srcpath, &ino, &inum) < 0) {
-       fclose(fp);
+       fs_destroy(&fs);
        exit(EXIT_FAILURE);
    }
 
@@ -72,7 +193,7 @@ main(int argc, char **argv)
 
    if (!fs_is_regular(&ino)) {
        fprintf(stderr, "%s is not a regular file.\n", srcpath);
-       fclose(fp);
+       fs_destroy(&fs);
        exit(EXIT_FAILURE);
    }
 
@@ -82,7 +203,7 @@ main(int argc, char **argv)
        out = fopen(dstpath, "wb");
        if (!out) {
            perror("fopen dstpath");
-           fclose(fp);
+           fs_destroy(&fs);
            exit(EXIT_FAILURE);
        }
    } 
@@ -92,258 +213,800 @@ main(int argc, char **argv)
    }
 
 
-   if (fs_copy_file_to_stream(&fs, &ino, out) < 0) {
-       if (dstpath && out != NULL && out != stdout) {
-           fclose(out);
+   if (opt.range_off >= 0 || opt.range_len >= 0) {
+       /* Ranged read (-o/-l): touch only the covering zones.  With
+        * -c the CRC covers just the bytes written. */
+       uint32_t crc = 0;
+
+       if (copy_range(&fs, srcpath, out, opt.range_off, opt.range_len,
+                      opt.checksum ? &crc : NULL) < 0) {
+           if (dstpath && out != NULL && out != stdout) {
+               fclose(out);
+           }
+           fs_destroy(&fs);
+           exit(EXIT_FAILURE);
+       }
+       if (opt.checksum) {
+           fprintf(stderr, "crc32 %08x %s\n", (unsigned int)crc, srcpath);
+       }
+   }
+   else {
+       uint32_t crc = 0;
+       int rc;
+
+       if (opt.checksum) {
+           rc = fs_copy_file_crc(&fs, -1, &ino, out, &crc);
+       }
+       else {
+           rc = fs_copy_file_to_stream(&fs, &ino, out);
+       }
+       if (rc < 0) {
+           if (dstpath && out != NULL && out != stdout) {
+               fclose(out);
+           }
+           fs_destroy(&fs);
+           exit(EXIT_FAILURE);
+       }
+       if (opt.checksum) {
+           fprintf(stderr, "crc32 %08x %s\n", (unsigned int)crc, srcpath);
        }
-       fclose(fp);
-       exit(EXIT_FAILURE);
    }
 
 
    if (dstpath && out != NULL && out != stdout) {
        fclose(out);
    }
-   fclose(fp);
+   if (opt.show_stats) {
+       fs_print_stats(&fs);
+   }
+   fs_destroy(&fs);
    return 0;
 }
 
 
+
+
 /*
- * copy_from_zone:
- *   Copy up to one filesystem zone worth of data for a file.
- *   If zone == 0, this is a hole: write zeros instead of reading.
- *   Decrements *remaining by the number of bytes written.
+ * copy_range:
+ *   Write [off, off+len) of 'srcpath' to 'out' (-o/-l).  Reads go
+ *   through a positional handle in copy-buffer-sized chunks, so only
+ *   the zones covering the range are ever read.  len < 0 means
+ *   through end of file.  When 'crc' is non-NULL it accumulates a
+ *   CRC-32 of exactly the bytes written.
  */
 static int
-copy_from_zone(const struct fs *fs,
-              uint32_t zone,
-              uint32_t *remaining,
-              FILE *out)
+copy_range(const struct fs *fs, const char *srcpath, FILE *out,
+           long off, long len, uint32_t *crc)
 {
-   char buffer[4096]; /* handle up to 4K blocks */
-   uint32_t zone_bytes = fs->zonesize;
-   uint32_t to_do;
+    struct fs_file *f;
+    unsigned char *buf;
+    long done = 0;
+    int rc = 0;
+
+    f = fs_open(fs, srcpath);
+    if (!f) {
+        return -1;
+    }
+    if (off < 0) {
+        off = 0;
+    }
+    if (len < 0) {
+        len = (long)f->ino.size - off;
+    }
+    if (len < 0) {
+        len = 0;
+    }
 
+    buf = malloc(fs->copybuf_bytes);
+    if (!buf) {
+        fprintf(stderr, "malloc range buffer\n");
+        fs_close(f);
+        return -1;
+    }
 
-   if (*remaining == 0)
-       return 0;
+    while (done < len) {
+        size_t want = (size_t)(len - done);
+        long got;
 
+        if (want > fs->copybuf_bytes) {
+            want = fs->copybuf_bytes;
+        }
+        got = fs_file_read(f, buf, want, off + done);
+        if (got < 0) {
+            rc = -1;
+            break;
+        }
+        if (got == 0) {
+            break;   /* EOF before 'len' bytes */
+        }
+        if (fwrite(buf, 1, (size_t)got, out) != (size_t)got) {
+            perror("fwrite out");
+            rc = -1;
+            break;
+        }
+        if (crc) {
+            *crc = fs_crc32(*crc, buf, (size_t)got);
+        }
+        done += got;
+    }
 
-   to_do = (*remaining < zone_bytes) ? *remaining : zone_bytes;
+    free(buf);
+    fs_close(f);
+    return rc;
+}
 
 
-   if (zone == 0) {
-       /* Hole: write zeros */
-       memset(buffer, 0, sizeof(buffer));
-       while (to_do > 0) {
-           uint32_t chunk = (to_do < sizeof(buffer)) ? to_do : sizeof(buffer);
-           if (fwrite(buffer, 1, chunk, out) != chunk) {
-               perror("fwrite hole");
-               return -1;
-           }
-           to_do      -= chunk;
-           *remaining -= chunk;
-       }
-       return 0;
-   }
+/* ----- Tar streaming (-t) ----- */
 
+#define TAR_BLOCK 512
 
-   {
-       long base = fs->fs_offset + (long)zone * fs->zonesize;
-       uint32_t left = to_do;
+/*
+ * tar_put_octal:
+ *   Write 'v' as a NUL-terminated zero-padded octal string into a
+ *   'width'-byte tar header field.
+ */
+static void
+tar_put_octal(char *field, int width, unsigned long v)
+{
+    int i = width - 1;
 
+    field[i--] = '\0';
+    while (i >= 0) {
+        field[i--] = (char)('0' + (v & 7));
+        v >>= 3;
+    }
+}
 
-       if (fseek(fs->fp, base, SEEK_SET) != 0) {
-           perror("fseek data zone");
-           return -1;
-       }
+/*
+ * tar_write_header:
+ *   Emit one ustar header block for 'path' (no leading slash;
+ *   directories end in '/').  'typeflag' is '0' for regular files,
+ *   '5' for directories.  Long names spill into the prefix field at
+ *   the last '/' that lets both halves fit.  Returns 0 on success,
+ *   -1 if the name cannot be represented or the write failed.
+ */
+static int
+tar_write_header(FILE *out, const char *path, const struct inode *ino,
+                 char typeflag)
+{
+    char hdr[TAR_BLOCK];
+    size_t len = strlen(path);
+    unsigned long sum = 0;
+    int i;
 
+    memset(hdr, 0, sizeof(hdr));
 
-       while (left > 0) {
-           uint32_t chunk = (left < sizeof(buffer)) ? left : sizeof(buffer);
-           if (fread(buffer, 1, chunk, fs->fp) != chunk) {
-               perror("fread data zone");
-               return -1;
-           }
-           if (fwrite(buffer, 1, chunk, out) != chunk) {
-               perror("fwrite out");
-               return -1;
-           }
-           left       -= chunk;
-           *remaining -= chunk;
-       }
-   }
+    if (len <= 100) {
+        memcpy(hdr, path, len);
+    }
+    else {
+        /* Split at a '/' so name <= 100 and prefix <= 155. */
+        const char *split = NULL;
+        const char *p;
+
+        for (p = path + len - 1; p > path; p--) {
+            if (*p == '/' &&
+                len - (size_t)(p + 1 - path) <= 100 &&
+                (size_t)(p - path) <= 155) {
+                split = p;
+                break;
+            }
+        }
+        if (!split) {
+            fprintf(stderr, "%s: name too long for ustar\n", path);
+            return -1;
+        }
+        memcpy(hdr + 345, path, (size_t)(split - path));
+        memcpy(hdr, split + 1, len - (size_t)(split + 1 - path));
+    }
 
+    tar_put_octal(hdr + 100, 8, (unsigned long)(ino->mode & 07777));
+    tar_put_octal(hdr + 108, 8, (unsigned long)ino->uid);
+    tar_put_octal(hdr + 116, 8, (unsigned long)ino->gid);
+    tar_put_octal(hdr + 124, 12,
+                  typeflag == '5' ? 0UL : (unsigned long)ino->size);
+    tar_put_octal(hdr + 136, 12, (unsigned long)(uint32_t)ino->mtime);
+    memset(hdr + 148, ' ', 8);   /* checksum counts as spaces */
+    hdr[156] = typeflag;
+    memcpy(hdr + 257, "ustar", 6);
+    memcpy(hdr + 263, "00", 2);
+
+    for (i = 0; i < TAR_BLOCK; i++) {
+        sum += (unsigned char)hdr[i];
+    }
+    tar_put_octal(hdr + 148, 7, sum);
+    hdr[155] = ' ';
 
-   return 0;
+    if (fwrite(hdr, 1, TAR_BLOCK, out) != TAR_BLOCK) {
+        perror("fwrite tar header");
+        return -1;
+    }
+    return 0;
 }
 
+/* State for the tar tree-walk callback. */
+struct tar_ctx {
+    FILE *out;
+    const char *prefix;      /* canonical subtree root ("/" = all) */
+    int failed;
+    int verbose;
+};
+
 /*
- * fs_copy_file_to_stream:
- *   Copy the contents of 'ino' to 'out'.
- *   Handles direct zones, single-indirect, and double-indirect zones.
- *   Only the first block of each indirect zone is used as a table of
- *   32-bit zone numbers; the rest of the zone is unused.
+ * tar_entry:
+ *   Emit one archive member: header, then for regular files the data
+ *   (straight off the single-pass copy engine) padded to a 512-byte
+ *   boundary.  The tar name is the image path without its leading
+ *   slash, with a trailing '/' added for directories.
  */
-int
-fs_copy_file_to_stream(const struct fs *fs,
-                       const struct inode *ino,
-                       FILE *out)
+static int
+tar_entry(const struct fs *fs, const char *path,
+          const struct inode *ino, struct tar_ctx *ctx)
+{
+    char name[1100];
+    size_t len;
+
+    len = strlen(path) - 1;      /* drop the leading '/' */
+    if (len + 2 > sizeof(name)) {
+        fprintf(stderr, "%s: path too long\n", path);
+        return -1;
+    }
+    memcpy(name, path + 1, len);
+    if (fs_is_dir(ino)) {
+        name[len++] = '/';
+        name[len] = '\0';
+        return tar_write_header(ctx->out, name, ino, '5');
+    }
+    name[len] = '\0';
+
+    if (tar_write_header(ctx->out, name, ino, '0') < 0) {
+        return -1;
+    }
+    if (fs_copy_file_to_stream(fs, ino, ctx->out) < 0) {
+        fprintf(stderr, "%s: read failed mid-archive\n", path);
+        return -1;
+    }
+    if (ino->size % TAR_BLOCK != 0) {
+        char pad[TAR_BLOCK];
+        size_t padlen = TAR_BLOCK - ino->size % TAR_BLOCK;
+
+        memset(pad, 0, padlen);
+        if (fwrite(pad, 1, padlen, ctx->out) != padlen) {
+            perror("fwrite tar padding");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+tar_walk_cb(const struct fs *fs, const char *path,
+            const struct inode *ino, uint32_t inum, void *arg)
+{
+    struct tar_ctx *ctx = arg;
+    size_t plen = strlen(ctx->prefix);
+
+    (void)inum;
+
+    if (strcmp(ctx->prefix, "/") != 0) {
+        if (strncmp(path, ctx->prefix, plen) != 0 ||
+            (path[plen] != '/' && path[plen] != '\0')) {
+            return 0;
+        }
+    }
+    if (!fs_is_dir(ino) && !fs_is_regular(ino)) {
+        if (ctx->verbose) {
+            fprintf(stderr, "%s: not a regular file, skipping\n", path);
+        }
+        return 0;
+    }
+    if (tar_entry(fs, path, ino, ctx) < 0) {
+        /* A short member corrupts everything after it; abort. */
+        ctx->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * tar_stream:
+ *   Stream a ustar archive of 'path' (a file, or a directory and
+ *   everything below it) to 'out' in one pass over the image: no
+ *   intermediate files, headers synthesized straight from the
+ *   inodes.  Returns 0 on success, -1 on error.
+ */
+static int
+tar_stream(struct fs *fs, const char *path, FILE *out, int verbose)
 {
-    uint32_t remaining = ino->size;
-    /* Number of 32-bit zone pointers that fit in one block 
-    of an indirect zone. */
-    uint32_t entries_per_ind = fs->blocksize / sizeof(uint32_t);
-    uint32_t block_index = 0;
-    uint32_t *ind1 = NULL;      /* single-indirect table (if present)*/
-    uint32_t *dbl1 = NULL;      /* first-level double-indirect table */
-    uint32_t *dbl2 = NULL;      /* cached second-level table*/
-    uint32_t dbl2_index = (uint32_t)-1;
-    size_t   ind_bytes = fs->blocksize;
-    int rc = -1;
+    struct tar_ctx ctx;
+    struct inode ino;
+    uint32_t inum = 0;
+    char canon[1024];
+    char zeros[2 * TAR_BLOCK];
+
+    if (fs_find_path(fs, path, &ino, &inum) < 0) {
+        return -1;
+    }
+    canonicalize_path(path, canon, sizeof(canon));
+
+    ctx.out = out;
+    ctx.prefix = canon;
+    ctx.failed = 0;
+    ctx.verbose = verbose;
+
+    if (fs_is_dir(&ino)) {
+        /* The walk visits every entry below the root, including the
+         * subtree directory itself, so no separate header is needed
+         * for it. */
+        fs_load_inode_table(fs);
+        fs_walk_tree(fs, tar_walk_cb, &ctx);
+        if (ctx.failed) {
+            return -1;
+        }
+    }
+    else if (fs_is_regular(&ino)) {
+        if (tar_entry(fs, canon, &ino, &ctx) < 0) {
+            return -1;
+        }
+    }
+    else {
+        fprintf(stderr, "%s is not a regular file.\n", path);
+        return -1;
+    }
+
+    /* End-of-archive marker: two zero blocks. */
+    memset(zeros, 0, sizeof(zeros));
+    if (fwrite(zeros, 1, sizeof(zeros), out) != sizeof(zeros)) {
+        perror("fwrite tar trailer");
+        return -1;
+    }
+    return 0;
+}
+
+
+/* ----- Batch extraction (-B) ----- */
+
+/* One resolved source file in a batch run. */
+struct batch_item {
+    char *src;             /* path inside the image */
+    struct inode ino;
+    uint32_t first_zone;   /* first allocated data zone, for sorting */
+};
+
+/*
+ * first_data_zone:
+ *   Return the first allocated data zone of 'ino' (0 if the file is
+ *   all holes).  Used only to order batch reads by disk offset, so
+ *   the direct zones plus the indirect pointer are a good enough key.
+ */
+static uint32_t
+first_data_zone(const struct inode *ino)
+{
+    int i;
+
+    for (i = 0; i < DIRECT_ZONES; i++) {
+        if (ino->zone[i] != 0) {
+            return ino->zone[i];
+        }
+    }
+    return ino->indirect;
+}
+
+static int
+batch_cmp(const void *a, const void *b)
+{
+    const struct batch_item *x = a;
+    const struct batch_item *y = b;
+
+    if (x->first_zone < y->first_zone) return -1;
+    if (x->first_zone > y->first_zone) return 1;
+    return 0;
+}
 
-    /* Load single-indirect table if present (only first block of zone). */
-    if (ino->indirect != 0) {
-        long off = fs->fs_offset + (long)ino->indirect * fs->zonesize;
+/*
+ * make_parent_dirs:
+ *   Create every missing directory leading up to 'path' (the final
+ *   component is the file itself and is skipped).
+ */
+static int
+make_parent_dirs(char *path)
+{
+    char *p;
 
-        ind1 = malloc(ind_bytes);
-        if (!ind1) {
-            fprintf(stderr, "malloc indirect\n");
-            goto done;
+    for (p = path + 1; *p != '\0'; p++) {
+        if (*p != '/') {
+            continue;
         }
-        if (fseek(fs->fp, off, SEEK_SET) != 0) {
-            perror("fseek indirect");
-            goto done;
+        *p = '\0';
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            perror("mkdir");
+            *p = '/';
+            return -1;
         }
-        if (fread(ind1, 1, ind_bytes, fs->fp) != ind_bytes) {
-            perror("fread indirect");
-            goto done;
+        *p = '/';
+    }
+    return 0;
+}
+
+/*
+ * extract_item:
+ *   Extract one resolved batch item under 'outdir', reading through
+ *   'fd' when it is a valid descriptor (worker threads) or through
+ *   the shared fs context otherwise.  With 'checksum' set, report
+ *   the file's CRC-32 on stderr as it is written.
+ */
+static int
+extract_item(const struct fs *fs, int fd, const struct batch_item *it,
+             const char *outdir, int checksum, int verbose)
+{
+    char canon[1024];
+    char dst[2048];
+    FILE *out;
+    uint32_t crc = 0;
+    int rc = 0;
+
+    canonicalize_path(it->src, canon, sizeof(canon));
+    if (strlen(outdir) + strlen(canon) + 1 > sizeof(dst)) {
+        fprintf(stderr, "%s: destination path too long\n", canon);
+        return -1;
+    }
+    sprintf(dst, "%s%s", outdir, canon);
+
+    if (make_parent_dirs(dst) < 0) {
+        return -1;
+    }
+
+    out = fopen(dst, "wb");
+    if (!out) {
+        perror("fopen dstpath");
+        return -1;
+    }
+    if (fs_copy_file_crc(fs, fd, &it->ino, out,
+                         checksum ? &crc : NULL) < 0) {
+        fprintf(stderr, "%s: extraction failed\n", canon);
+        rc = -1;
+    }
+    fclose(out);
+
+    if (checksum && rc == 0) {
+        fprintf(stderr, "crc32 %08x %s\n", (unsigned int)crc, canon);
+    }
+    if (verbose && rc == 0) {
+        fprintf(stderr, "extracted %s -> %s\n", canon, dst);
+    }
+    return rc;
+}
+
+/* Shared state for the batch worker pool. */
+struct batch_pool {
+    const struct fs *fs;
+    const char *imagefile;
+    const char *outdir;
+    struct batch_item *items;
+    size_t nitems;
+    size_t next;           /* next unclaimed item */
+    int failed;
+    int checksum;
+    int verbose;
+    pthread_mutex_t lock;
+};
+
+/*
+ * batch_worker:
+ *   Pull items off the pool queue until it is empty.  Each worker
+ *   opens its own descriptor so reads go through pread and never
+ *   touch the shared (non-thread-safe) FILE* in struct fs.
+ */
+static void *
+batch_worker(void *arg)
+{
+    struct batch_pool *pool = arg;
+    int fd = -1;
+
+    if (!pool->fs->map) {
+        fd = open(pool->imagefile, O_RDONLY);
+        if (fd < 0) {
+            perror("open imagefile");
+            pthread_mutex_lock(&pool->lock);
+            pool->failed = 1;
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
         }
     }
 
-    /* Load first-level double-indirect table if present (only first block). */
-    if (ino->two_indirect != 0) {
-        long off = fs->fs_offset + (long)ino->two_indirect * fs->zonesize;
+    for (;;) {
+        size_t i;
 
-        dbl1 = malloc(ind_bytes);
-        if (!dbl1) {
-            fprintf(stderr, "malloc two_indirect\n");
-            goto done;
+        pthread_mutex_lock(&pool->lock);
+        i = pool->next;
+        if (i < pool->nitems) {
+            pool->next++;
         }
-        if (fseek(fs->fp, off, SEEK_SET) != 0) {
-            perror("fseek two_indirect");
-            goto done;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->nitems) {
+            break;
         }
-        if (fread(dbl1, 1, ind_bytes, fs->fp) != ind_bytes) {
-            perror("fread two_indirect");
-            goto done;
+
+        if (extract_item(pool->fs, fd, &pool->items[i],
+                         pool->outdir, pool->checksum,
+                         pool->verbose) < 0) {
+            pthread_mutex_lock(&pool->lock);
+            pool->failed = 1;
+            pthread_mutex_unlock(&pool->lock);
         }
     }
 
-    /* Walk the file block-by-block until we've produced all bytes. */
-    while (remaining > 0) {
-        uint32_t zone = 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * run_batch:
+ *   Extract an array of resolved items under 'outdir' in on-disk
+ *   order, with a worker pool when jobs > 1.  Takes ownership of
+ *   'items' (paths and array are freed).  Returns -1 if any file
+ *   failed, 0 otherwise.
+ */
+static int
+run_batch(struct fs *fs, const char *imagefile, const char *outdir,
+          struct batch_item *items, size_t nitems, int jobs,
+          int checksum, int verbose)
+{
+    size_t i;
+    int failed = 0;
 
-        if (block_index < DIRECT_ZONES) {
-            /* Direct zones */
-            zone = ino->zone[block_index];
+    /* Extract in on-disk order. */
+    qsort(items, nitems, sizeof(*items), batch_cmp);
 
-        } 
-        else if (block_index < DIRECT_ZONES + entries_per_ind) {
-            /* Single-indirect region */
-            uint32_t idx = block_index - DIRECT_ZONES;
+    if (checksum) {
+        /* Prime the lazily built CRC table from one thread before
+         * workers can race to initialize it. */
+        fs_crc32(0, "", 0);
+    }
 
-            if (ind1) {
-                zone = ind1[idx];
+    if (jobs > 1 && nitems > 1) {
+        struct batch_pool pool;
+        pthread_t *tids;
+        int t, nthreads;
+
+        nthreads = (size_t)jobs < nitems ? jobs : (int)nitems;
+
+        pool.fs = fs;
+        pool.imagefile = imagefile;
+        pool.outdir = outdir;
+        pool.items = items;
+        pool.nitems = nitems;
+        pool.next = 0;
+        pool.failed = failed;
+        pool.checksum = checksum;
+        pool.verbose = verbose;
+        pthread_mutex_init(&pool.lock, NULL);
+
+        tids = malloc(nthreads * sizeof(*tids));
+        if (!tids) {
+            fprintf(stderr, "malloc thread ids\n");
+            pool.failed = 1;
+            nthreads = 0;
+        }
+        for (t = 0; t < nthreads; t++) {
+            if (pthread_create(&tids[t], NULL, batch_worker, &pool) != 0) {
+                perror("pthread_create");
+                pool.failed = 1;
+                break;
             }
-            else {
-                /* No indirect block allocated: this whole region is a hole. */
-                zone = 0;
+        }
+        while (--t >= 0) {
+            pthread_join(tids[t], NULL);
+        }
+        free(tids);
+        pthread_mutex_destroy(&pool.lock);
+        failed = pool.failed;
+    }
+    else {
+        for (i = 0; i < nitems; i++) {
+            if (extract_item(fs, -1, &items[i], outdir,
+                             checksum, verbose) < 0) {
+                failed = 1;
             }
+        }
+    }
 
-        } 
-        else {
-            /* Double-indirect region */
-            uint32_t idx2 = block_index - DIRECT_ZONES - entries_per_ind;
-            uint32_t l1 = idx2 / entries_per_ind;  /* index into dbl1 */
-            uint32_t l2 = idx2 % entries_per_ind;
+    for (i = 0; i < nitems; i++) {
+        free(items[i].src);
+    }
+    free(items);
 
-            /* Beyond what a double-indirect can address: stop. */
-            if (l1 >= entries_per_ind) {
-                break;
-            }
+    return failed ? -1 : 0;
+}
 
-            if (!dbl1) {
-                /* No double-indirect table: this whole region is a hole. */
-                zone = 0;
-            } 
-            else {
-                uint32_t l2_zone = dbl1[l1];
-
-                if (l2_zone == 0) {
-                    /* This entire second-level block is a hole. */
-                    zone = 0;
-                } 
-                else {
-                    /* Load or reuse second-level table for this l1. */
-                    if (dbl2_index != l1) {
-                        long off = fs->fs_offset +
-                                   (long)l2_zone * fs->zonesize;
-
-                        dbl2 = malloc(ind_bytes);
-                        if (!dbl2) {
-                            fprintf(stderr, "malloc dbl2\n");
-                            goto done;
-                        }
-                            
-                        if (fseek(fs->fp, off, SEEK_SET) != 0) {
-                            perror("fseek dbl2");
-                            goto done;
-                        }
-                        if (fread(dbl2, 1, ind_bytes, fs->fp) != ind_bytes) {
-                            perror("fread dbl2");
-                            goto done;
-                        }
-                        dbl2_index = l1;
-                    }
-
-                    zone = dbl2[l2];
-                }
-            }
+
+/*
+ * batch_extract:
+ *   Read source paths (one per line) from 'listfile', resolve them
+ *   all up front, sort by first data zone so extraction sweeps the
+ *   image mostly sequentially, and copy each file under 'outdir'
+ *   (mirroring its path).  With -j N, N worker threads drain the
+ *   sorted queue concurrently.  Continues past per-file failures;
+ *   returns -1 if any file failed, 0 if all succeeded.
+ */
+static int
+batch_extract(struct fs *fs, const char *imagefile, const char *listfile,
+              const char *outdir, int jobs, int checksum, int verbose)
+{
+    FILE *lf;
+    char line[1024];
+    struct batch_item *items = NULL;
+    size_t nitems = 0, cap = 0;
+    int failed = 0;
+
+    lf = fopen(listfile, "r");
+    if (!lf) {
+        perror("fopen listfile");
+        return -1;
+    }
+
+    /* Pass 1: resolve every path (directory zones stay cached). */
+    while (fgets(line, sizeof(line), lf) != NULL) {
+        struct inode ino;
+        uint32_t inum = 0;
+        size_t len = strlen(line);
+
+        while (len > 0 &&
+               (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
         }
 
-        /* zone == 0 means "hole": copy_from_zone will write zeros. */
-        if (copy_from_zone(fs, zone, &remaining, out) < 0) {
-            goto done;
+        if (fs_find_path(fs, line, &ino, &inum) < 0) {
+            fprintf(stderr, "%s: not found, skipping\n", line);
+            failed = 1;
+            continue;
         }
+        if (!fs_is_regular(&ino)) {
+            fprintf(stderr, "%s: not a regular file, skipping\n", line);
+            failed = 1;
+            continue;
+        }
+
+        if (nitems == cap) {
+            struct batch_item *tmp;
 
-        block_index++;
+            cap = cap ? cap * 2 : 64;
+            tmp = realloc(items, cap * sizeof(*items));
+            if (!tmp) {
+                fprintf(stderr, "realloc batch items\n");
+                failed = 1;
+                break;
+            }
+            items = tmp;
+        }
+        items[nitems].src = malloc(len + 1);
+        if (!items[nitems].src) {
+            fprintf(stderr, "malloc batch path\n");
+            failed = 1;
+            break;
+        }
+        memcpy(items[nitems].src, line, len + 1);
+        items[nitems].ino = ino;
+        items[nitems].first_zone = first_data_zone(&ino);
+        nitems++;
     }
+    fclose(lf);
 
-    if (remaining != 0) {
-        /* File bigger than we can address even with double-indirect. */
-        fprintf(stderr,
-                "Warning: file has %u more bytes than handled "
-                "(indirects not fully implemented)\n",
-                remaining);
-        goto done;
+    if (run_batch(fs, imagefile, outdir, items, nitems,
+                  jobs, checksum, verbose) < 0) {
+        failed = 1;
     }
+    return failed ? -1 : 0;
+}
 
-    rc = 0;
 
-done:
-    if (ind1) {
-        free(ind1);
-    }
+/* State for the -a tree-walk collector. */
+struct all_collect {
+    struct batch_item *items;
+    size_t n;
+    size_t cap;
+    const char *outdir;
+    int failed;
+    int verbose;
+};
+
+/*
+ * collect_all_cb:
+ *   fs_walk_tree callback for -a.  Directories are created eagerly
+ *   (so empty ones are mirrored too); regular files are queued for
+ *   the batch engine; anything else is skipped.
+ */
+static int
+collect_all_cb(const struct fs *fs, const char *path,
+               const struct inode *ino, uint32_t inum, void *arg)
+{
+    struct all_collect *c = arg;
+    size_t len = strlen(path);
 
-    if (dbl1) {
-        free(dbl1);
+    (void)inum;
+
+    if (fs_is_dir(ino)) {
+        char dst[2048];
+
+        if (strlen(c->outdir) + len + 1 > sizeof(dst)) {
+            fprintf(stderr, "%s: destination path too long\n", path);
+            c->failed = 1;
+            return 0;
+        }
+        sprintf(dst, "%s%s", c->outdir, path);
+        if (mkdir(dst, 0755) != 0 && errno != EEXIST) {
+            perror("mkdir");
+            c->failed = 1;
+        }
+        return 0;
+    }
+    if (!fs_is_regular(ino)) {
+        if (c->verbose) {
+            fprintf(stderr, "%s: not a regular file, skipping\n", path);
+        }
+        return 0;
     }
 
-    if (dbl2) {
-        free(dbl2);
+    if (c->n == c->cap) {
+        struct batch_item *tmp;
+
+        c->cap = c->cap ? c->cap * 2 : 64;
+        tmp = realloc(c->items, c->cap * sizeof(*c->items));
+        if (!tmp) {
+            fprintf(stderr, "realloc extract-all items\n");
+            return -1;
+        }
+        c->items = tmp;
     }
+    c->items[c->n].src = malloc(len + 1);
+    if (!c->items[c->n].src) {
+        fprintf(stderr, "malloc extract-all path\n");
+        return -1;
+    }
+    memcpy(c->items[c->n].src, path, len + 1);
+    c->items[c->n].ino = *ino;
+    c->items[c->n].first_zone = first_data_zone(ino);
+    c->n++;
+    return 0;
+}
 
-    return rc;
+/*
+ * extract_all:
+ *   Mirror the entire image under 'outdir' (-a): one tree walk
+ *   collects every directory and regular file, then the batch engine
+ *   extracts the files in on-disk order, across -j workers.
+ */
+static int
+extract_all(struct fs *fs, const char *imagefile, const char *outdir,
+            int jobs, int checksum, int verbose)
+{
+    struct all_collect c;
+    int failed = 0;
+
+    memset(&c, 0, sizeof(c));
+    c.outdir = outdir;
+    c.verbose = verbose;
+
+    if (mkdir(outdir, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir outdir");
+        return -1;
+    }
+    if (fs_walk_tree(fs, collect_all_cb, &c) < 0) {
+        failed = 1;
+    }
+    if (c.failed) {
+        failed = 1;
+    }
+    if (run_batch(fs, imagefile, outdir, c.items, c.n,
+                  jobs, checksum, verbose) < 0) {
+        failed = 1;
+    }
+    return failed ? -1 : 0;
 }
+
+
@@ -0,0 +1,199 @@
+/*
+ * minix_cli.c – command-line layer shared by minls and minget.
+ * Option parsing and usage text live here so that libminixfs.a
+ * stays free of getopt/exit and can be embedded in other programs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "minix_fs.h"
+
+/* For getopt */
+extern int getopt(int argc, char * const argv[], const char *optstring);
+extern int opterr;
+extern int optind;
+extern char *optarg;
+
+static void
+usage_minls(void)
+{
+   fprintf(stderr,
+       "usage: minls [ -v ] [ -R ] [ -p num [ -s num ] ] "
+       "imagefile [ path ]\n\n"
+       "Options:\n"
+       "-p part --- select partition for filesystem (default: none)\n"
+       "-s sub --- select subpartition for filesystem (default: none)\n"
+       "-R recursive --- list the directory tree recursively\n");
+   fprintf(stderr,
+       "-x index --- (re)build the path index sidecar\n"
+       "-c checksum --- print a CRC-32 for each regular file\n"
+       "-M path --- look up 'path' in every listed image\n"
+       "-q quick --- fast stat: one path, minimal reads, no caches\n"
+       "-U usage --- report inode/zone allocation from the bitmaps\n");
+   fprintf(stderr,
+       "-g pat --- list only names matching glob 'pat' (* and ?)\n"
+       "-j n --- worker threads for the -M image sweep (default: 1)\n"
+       "-C mb --- zone cache size in MB (default: 4, 0 disables)\n"
+       "-S stats --- dump I/O statistics at exit\n"
+       "-h help --- print usage information and exit\n"
+       "-v verbose --- increase verbosity level\n");
+}
+
+
+static void
+usage_minget(void)
+{
+   fprintf(stderr,
+       "usage: minget [ -v ] [ -p num [ -s num ] ] imagefile "
+       "srcpath [ dstpath ]\n\n"
+
+
+       "Options:\n"
+       "-p part --- select partition for filesystem (default: none)\n"
+       "-s sub --- select subpartition for filesystem (default: none)\n"
+       "-C mb --- zone cache size in MB (default: 4, 0 disables)\n"
+       "-w mb --- copy buffer size in MB (default: 4)\n");
+   fprintf(stderr,
+       "-a all --- extract the entire tree to outdir\n"
+       "-B list --- batch mode: extract paths in 'list' to outdir\n"
+       "-j n --- worker threads for batch mode (default: 1)\n"
+       "-o off --- start reading srcpath at byte offset 'off'\n"
+       "-l len --- read at most 'len' bytes of srcpath\n"
+       "-c checksum --- report each file's CRC-32 on stderr\n"
+       "-t tar --- stream a ustar archive of the tree to stdout\n"
+       "-S stats --- dump I/O statistics at exit\n"
+       "-h help --- print usage information and exit\n"
+       "-v verbose --- increase verbosity level\n");
+}
+
+
+/*
+ * parse_common_options:
+ *   Parse shared command-line options for minls and minget.
+ *   Fills in 'opt' with verbose/partition/subpartition flags and
+ *   leaves *rest pointing at the remaining argv (imagefile + paths).
+ *   'need_path_args' is not enforced here; each main() does its own
+ *   argument validation after this call.
+ */
+int
+parse_common_options(int argc, char **argv,
+                    struct options *opt,
+                    int need_path_args,
+                    char ***rest)
+{
+   int c;
+   int is_minls = (strstr(argv[0], "minls") != NULL);
+
+
+   opt->verbose = 0;
+   opt->have_partition = 0;
+   opt->have_subpartition = 0;
+   opt->part = 0;
+   opt->subpart = 0;
+   opt->cache_mb = 4;
+   opt->copybuf_mb = 4;
+   opt->batchfile = NULL;
+   opt->jobs = 1;
+   opt->recursive = 0;
+   opt->build_index = 0;
+   opt->show_stats = 0;
+   opt->extract_all = 0;
+   opt->range_off = -1;
+   opt->range_len = -1;
+   opt->checksum = 0;
+   opt->multi = NULL;
+   opt->quick = 0;
+   opt->usage_report = 0;
+   opt->tar = 0;
+   opt->glob = NULL;
+
+
+   opterr = 0;
+
+
+   while ((c = getopt(argc, argv, "vRxSacqtUp:s:C:w:B:j:o:l:M:g:h")) != -1) {
+       switch (c) {
+       case 'v':
+           opt->verbose = 1;
+           break;
+       case 'S':
+           opt->show_stats = 1;
+           break;
+       case 'R':
+           opt->recursive = 1;
+           break;
+       case 'x':
+           opt->build_index = 1;
+           break;
+       case 'a':
+           opt->extract_all = 1;
+           break;
+       case 'c':
+           opt->checksum = 1;
+           break;
+       case 'q':
+           opt->quick = 1;
+           break;
+       case 'U':
+           opt->usage_report = 1;
+           break;
+       case 't':
+           opt->tar = 1;
+           break;
+       case 'p':
+           opt->have_partition = 1;
+           opt->part = atoi(optarg);
+           break;
+       case 's':
+           opt->have_subpartition = 1;
+           opt->subpart = atoi(optarg);
+           break;
+       case 'C':
+           opt->cache_mb = atoi(optarg);
+           break;
+       case 'w':
+           opt->copybuf_mb = atoi(optarg);
+           if (opt->copybuf_mb < 1) {
+               opt->copybuf_mb = 1;
+           }
+           break;
+       case 'B':
+           opt->batchfile = optarg;
+           break;
+       case 'M':
+           opt->multi = optarg;
+           break;
+       case 'g':
+           opt->glob = optarg;
+           break;
+       case 'j':
+           opt->jobs = atoi(optarg);
+           if (opt->jobs < 1) {
+               opt->jobs = 1;
+           }
+           break;
+       case 'o':
+           opt->range_off = atol(optarg);
+           break;
+       case 'l':
+           opt->range_len = atol(optarg);
+           break;
+       case 'h':
+       default:
+           if (is_minls) {
+               usage_minls();
+           }
+           else {
+               usage_minget();
+           }
+           exit(EXIT_FAILURE);
+       }
+   }
+
+
+   *rest = &argv[optind];
+
+   return 0;
+}
@@ -4,104 +4,317 @@
  * directory traversal, and file reading (including indirect blocks).
  */
 
+#define _XOPEN_SOURCE 600   /* for mmap/munmap/fstat with -ansi */
+#ifdef __linux__
+#define _GNU_SOURCE         /* splice/sendfile for the zero-copy path */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <errno.h>
+#endif
 #include "minix_fs.h"
 
-/* For getopt */
-extern int getopt(int argc, char * const argv[], const char *optstring);
-extern int opterr;
-extern int optind;
-extern char *optarg;
 
-static void
-usage_minls(void)
+/* ----- Low-level image access ----- */
+
+/* Associativity of the zone cache: LRU eviction within each set. */
+#define CACHE_WAYS 4
+
+static const unsigned char *cache_borrow(const struct fs *fs,
+                                         long off, size_t len);
+static void inode_cache_setup(struct fs *fs);
+static void dirhash_free(struct fs *fs);
+
+/* Bump a hot-path counter.  The fs is const-qualified on most read
+ * paths; counters are bookkeeping, not fs state, so casting is fine
+ * (same rationale as the caches).  Approximate under -j workers. */
+#define STAT_BUMP(fs, field, n) (((struct fs *)(fs))->stats.field += (n))
+
+/*
+ * raw_read:
+ *   Lowest-level image read: pread on fs->fd, so it is positionless
+ *   (one syscall, no seek) and safe to issue from any thread.  Falls
+ *   back to fseek+fread for streams without a descriptor.  Returns
+ *   the number of bytes actually read (short at EOF), or 0 on error.
+ */
+static size_t
+raw_read(const struct fs *fs, long off, void *buf, size_t len)
 {
-   fprintf(stderr,
-       "usage: minls [ -v ] [ -p num [ -s num ] ] imagefile [ path ]\n\n"
-       "Options:\n"
-       "-p part --- select partition for filesystem (default: none)\n"
-       "-s sub --- select subpartition for filesystem (default: none)\n"
-       "-h help --- print usage information and exit\n"
-       "-v verbose --- increase verbosity level\n");
+    if (fs->fd >= 0) {
+        size_t done = 0;
+
+        while (done < len) {
+            ssize_t n = pread(fs->fd, (char *)buf + done, len - done,
+                              off + (long)done);
+
+            if (n < 0) {
+                perror("pread image");
+                return 0;
+            }
+            if (n == 0) {
+                break;      /* EOF: short read */
+            }
+            done += (size_t)n;
+        }
+        STAT_BUMP(fs, reads, 1);
+        STAT_BUMP(fs, bytes_read, done);
+        return done;
+    }
+
+    if (fseek(fs->fp, off, SEEK_SET) != 0) {
+        perror("fseek image");
+        return 0;
+    }
+    {
+        size_t got = fread(buf, 1, len, fs->fp);
+
+        STAT_BUMP(fs, reads, 1);
+        STAT_BUMP(fs, bytes_read, got);
+        return got;
+    }
+}
+
+/*
+ * fs_read_at:
+ *   Read 'len' bytes at absolute byte offset 'off' in the image into
+ *   'buf'.  Served from the mmap'd image when available, then the
+ *   zone cache, then a raw pread.
+ *   Returns 0 on success, -1 on error (including short reads).
+ */
+int
+fs_read_at(const struct fs *fs, long off, void *buf, size_t len)
+{
+    if (fs->map) {
+        if (off < 0 || (size_t)off + len > fs->map_size) {
+            fprintf(stderr, "read past end of image (off=%ld len=%lu)\n",
+                    off, (unsigned long)len);
+            return -1;
+        }
+        memcpy(buf, fs->map + off, len);
+        return 0;
+    }
+
+    {
+        const unsigned char *c = cache_borrow(fs, off, len);
+
+        if (c) {
+            memcpy(buf, c, len);
+            return 0;
+        }
+    }
+
+    if (raw_read(fs, off, buf, len) != len) {
+        fprintf(stderr, "short read at offset %ld\n", off);
+        return -1;
+    }
+    return 0;
 }
 
+/*
+ * fs_data_ptr:
+ *   Return a zero-copy pointer to 'len' bytes at absolute offset 'off'
+ *   in the mapped image, or NULL if the image is not mapped (or the
+ *   range is out of bounds).  Callers must fall back to fs_read_at.
+ */
+const void *
+fs_data_ptr(const struct fs *fs, long off, size_t len)
+{
+    if (!fs->map || off < 0 || (size_t)off + len > fs->map_size) {
+        return NULL;
+    }
+    return fs->map + off;
+}
 
+/*
+ * fs_map_image:
+ *   Try to mmap the whole image read-only.  Failure is not fatal;
+ *   we just keep the stdio path.
+ */
 static void
-usage_minget(void)
+fs_map_image(struct fs *fs)
 {
-   fprintf(stderr,
-       "usage: minget [ -v ] [ -p num [ -s num ] ] imagefile "
-       "srcpath [ dstpath ]\n\n"
+    struct stat st;
+    void *m;
+    int fd = fileno(fs->fp);
 
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size <= 0) {
+        return;
+    }
 
-       "Options:\n"
-       "-p part --- select partition for filesystem (default: none)\n"
-       "-s sub --- select subpartition for filesystem (default: none)\n"
-       "-h help --- print usage information and exit\n"
-       "-v verbose --- increase verbosity level\n");
-}
+    m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) {
+        return;
+    }
 
+    fs->map = m;
+    fs->map_size = (size_t)st.st_size;
+}
 
 /*
- * parse_common_options:
- *   Parse shared command-line options for minls and minget.
- *   Fills in 'opt' with verbose/partition/subpartition flags and
- *   leaves *rest pointing at the remaining argv (imagefile + paths).
- *   'need_path_args' is not enforced here; each main() does its own
- *   argument validation after this call.
+ * cache_setup:
+ *   Size the zone cache from the -C option (in MB).  Pointless when
+ *   the image is mapped, so skipped in that case.  Slot data buffers
+ *   are allocated lazily on first use.
  */
-int
-parse_common_options(int argc, char **argv,
-                    struct options *opt,
-                    int need_path_args,
-                    char ***rest)
+static void
+cache_setup(struct fs *fs, int cache_mb)
 {
-   int c;
-   int is_minls = (strstr(argv[0], "minls") != NULL);
+    uint32_t nslots;
+    uint32_t i;
 
+    if (fs->map || cache_mb <= 0 || fs->zonesize == 0) {
+        return;
+    }
 
-   opt->verbose = 0;
-   opt->have_partition = 0;
-   opt->have_subpartition = 0;
-   opt->part = 0;
-   opt->subpart = 0;
+    nslots = ((uint32_t)cache_mb * 1024 * 1024) / fs->zonesize;
+    if (nslots < CACHE_WAYS) {
+        nslots = CACHE_WAYS;
+    }
+    nslots -= nslots % CACHE_WAYS;
 
+    fs->cache = calloc(nslots, sizeof(struct fs_cache_slot));
+    if (!fs->cache) {
+        return;             /* cache is best-effort */
+    }
+    for (i = 0; i < nslots; i++) {
+        fs->cache[i].off = -1;
+    }
+    fs->cache_slots = nslots;
+}
 
-   opterr = 0; 
+/*
+ * cache_borrow:
+ *   Return a pointer into the cached copy of the zonesize-aligned
+ *   chunk covering [off, off+len), loading it on a miss.  Returns
+ *   NULL if caching is off, the range straddles a chunk boundary,
+ *   or the image ends before off+len; callers then read directly.
+ *   Eviction is LRU within a CACHE_WAYS-slot set.
+ */
+static const unsigned char *
+cache_borrow(const struct fs *cfs, long off, size_t len)
+{
+    /* The cache is internal bookkeeping; logically the fs is const. */
+    struct fs *fs = (struct fs *)cfs;
+    long rel, chunk_off;
+    size_t in_chunk;
+    uint32_t set, i, victim;
+    unsigned long oldest;
+    struct fs_cache_slot *s;
+
+    if (!fs->cache) {
+        return NULL;
+    }
+    rel = off - fs->fs_offset;
+    if (rel < 0) {
+        return NULL;
+    }
+    chunk_off = off - (rel % (long)fs->zonesize);
+    in_chunk = (size_t)(off - chunk_off);
+    if (in_chunk + len > fs->zonesize) {
+        return NULL;
+    }
 
+    set = (uint32_t)((chunk_off / fs->zonesize)
+          % (fs->cache_slots / CACHE_WAYS)) * CACHE_WAYS;
+    victim = set;
+    oldest = (unsigned long)-1;
+    for (i = set; i < set + CACHE_WAYS; i++) {
+        s = &fs->cache[i];
+        if (s->data && s->off == chunk_off) {
+            s->stamp = ++fs->cache_tick;
+            if (in_chunk + len > s->valid) {
+                return NULL;
+            }
+            STAT_BUMP(fs, cache_hits, 1);
+            return s->data + in_chunk;
+        }
+        if (s->stamp < oldest) {
+            oldest = s->stamp;
+            victim = i;
+        }
+    }
 
-   while ((c = getopt(argc, argv, "vp:s:h")) != -1) {
-       switch (c) {
-       case 'v':
-           opt->verbose = 1;
-           break;
-       case 'p':
-           opt->have_partition = 1;
-           opt->part = atoi(optarg);
-           break;
-       case 's':
-           opt->have_subpartition = 1;
-           opt->subpart = atoi(optarg);
-           break;
-       case 'h':
-       default:
-           if (is_minls) {
-               usage_minls();
-           } 
-           else {
-               usage_minget();
-           }
-           exit(EXIT_FAILURE);
-       }
-   }
+    /* Miss: load the chunk into the LRU slot of this set. */
+    STAT_BUMP(fs, cache_misses, 1);
+    s = &fs->cache[victim];
+    if (!s->data) {
+        s->data = malloc(fs->zonesize);
+        if (!s->data) {
+            return NULL;
+        }
+    }
+    s->off = -1;
+    s->valid = raw_read(fs, chunk_off, s->data, fs->zonesize);
+    s->off = chunk_off;
+    s->stamp = ++fs->cache_tick;
+    if (in_chunk + len > s->valid) {
+        return NULL;
+    }
+    return s->data + in_chunk;
+}
 
+/*
+ * fs_destroy:
+ *   Tear down an fs context: unmap the image (if mapped), release the
+ *   zone cache, and close the underlying stream.  Safe to call after
+ *   a failed fs_init.
+ */
+void
+fs_destroy(struct fs *fs)
+{
+    if (fs->map) {
+        munmap((void *)fs->map, fs->map_size);
+        fs->map = NULL;
+        fs->map_size = 0;
+    }
+    if (fs->cache) {
+        uint32_t i;
 
-   *rest = &argv[optind];
+        for (i = 0; i < fs->cache_slots; i++) {
+            free(fs->cache[i].data);
+        }
+        free(fs->cache);
+        fs->cache = NULL;
+        fs->cache_slots = 0;
+    }
+    if (fs->islabs) {
+        uint32_t i;
 
-   return 0;
+        for (i = 0; i < fs->islab_count; i++) {
+            free(fs->islabs[i]);
+        }
+        free(fs->islabs);
+        fs->islabs = NULL;
+        fs->islab_count = 0;
+    }
+    dirhash_free(fs);
+    free(fs->pcache);
+    fs->pcache = NULL;
+    free(fs->imap);
+    free(fs->zmap);
+    fs->imap = NULL;
+    fs->zmap = NULL;
+    if (fs->idx_count) {
+        free(fs->idx_paths);
+        free(fs->idx_offs);
+        free(fs->idx_inums);
+        fs->idx_paths = NULL;
+        fs->idx_offs = NULL;
+        fs->idx_inums = NULL;
+        fs->idx_count = 0;
+    }
+    if (fs->fp) {
+        fclose(fs->fp);
+        fs->fp = NULL;
+    }
 }
 
 
@@ -113,17 +326,12 @@ parse_common_options(int argc, char **argv,
  *   Returns 0 on success, -1 on error or invalid signature.
  */
 static int
-read_boot_signature(FILE *fp, long base)
+read_boot_signature(const struct fs *fs, long base)
 {
    unsigned char sig[2];
 
 
-   if (fseek(fp, base + BOOT_SIG_OFFSET_1, SEEK_SET) != 0) {
-       perror("fseek boot signature");
-       return -1;
-   }
-   if (fread(sig, 1, 2, fp) != 2) {
-       perror("fread boot signature");
+   if (fs_read_at(fs, base + BOOT_SIG_OFFSET_1, sig, 2) != 0) {
        return -1;
    }
    if (sig[0] != BOOT_SIG_BYTE_1 || sig[1] != BOOT_SIG_BYTE_2) {
@@ -139,7 +347,7 @@ read_boot_signature(FILE *fp, long base)
  *   Returns 0 on success, -1 on error or invalid index.
  */
 static int
-read_partition_entry(FILE *fp, long base, int index,
+read_partition_entry(const struct fs *fs, long base, int index,
                     struct partition_entry *p)
 {
        long off = base + PART_TABLE_OFFSET
@@ -152,12 +360,7 @@ read_partition_entry(FILE *fp, long base, int index,
        fprintf(stderr, "Invalid partition index %d\n", index);
        return -1;
    }
-   if (fseek(fp, off, SEEK_SET) != 0) {
-       perror("fseek partition table");
-       return -1;
-   }
-   if (fread(p, sizeof(*p), 1, fp) != 1) {
-       perror("fread partition entry");
+   if (fs_read_at(fs, off, p, sizeof(*p)) != 0) {
        return -1;
    }
    return 0;
@@ -176,12 +379,7 @@ int
 fs_read_super(struct fs *fs, int verbose)
 {
    /* Superblock is at block 1 (offset 1024 bytes from filesystem start) */
-   if (fseek(fs->fp, fs->fs_offset + 1024, SEEK_SET) != 0) {
-       perror("fseek superblock");
-       return -1;
-   }
-   if (fread(&fs->sb, sizeof(fs->sb), 1, fs->fp) != 1) {
-       perror("fread superblock");
+   if (fs_read_at(fs, fs->fs_offset + 1024, &fs->sb, sizeof(fs->sb)) != 0) {
        return -1;
    }
    if (fs->sb.magic != MINIX_MAGIC) {
@@ -231,21 +429,37 @@ fs_init(struct fs *fs, FILE *fp, const struct options *opt, int verbose)
 
     memset(fs, 0, sizeof(*fs));
     fs->fp = fp;
+    fs->fd = fileno(fp);
     fs->fs_offset = 0;
+    fs->copybuf_bytes = (uint32_t)(opt->copybuf_mb > 0
+                                   ? opt->copybuf_mb : 4) << 20;
+
+    /* Map the whole image up front if we can; offsets below are all
+     * absolute, so partitioned images work the same way.  Quick mode
+     * (-q) skips the mapping and all cache setup: a single lookup
+     * touches too few blocks to amortize any of it, and the probe
+     * should disturb the page cache as little as possible. */
+    if (!opt->quick) {
+        fs_map_image(fs);
+    }
 
     /* Unpartitioned image: just read superblock directly. */
     if (!opt->have_partition && !opt->have_subpartition) {
         if (fs_read_super(fs, verbose) < 0)
             return -1;
+        if (!opt->quick) {
+            cache_setup(fs, opt->cache_mb);
+            inode_cache_setup(fs);
+        }
         return 0;
     }
 
     /* Step 1: read primary partition table from MBR */
-    if (read_boot_signature(fp, 0) < 0)
+    if (read_boot_signature(fs, 0) < 0)
         return -1;
 
     if (opt->have_partition) {
-        if (read_partition_entry(fp, 0, opt->part, &p) < 0)
+        if (read_partition_entry(fs, 0, opt->part, &p) < 0)
             return -1;
 
         if (p.type != MINIX_PARTTYPE) {
@@ -268,10 +482,10 @@ fs_init(struct fs *fs, FILE *fp, const struct options *opt, int verbose)
     if (opt->have_subpartition) {
         struct partition_entry sub;
 
-        if (read_boot_signature(fp, base) < 0)
+        if (read_boot_signature(fs, base) < 0)
             return -1;
 
-        if (read_partition_entry(fp, base, opt->subpart, &sub) < 0)
+        if (read_partition_entry(fs, base, opt->subpart, &sub) < 0)
             return -1;
 
         if (sub.type != MINIX_PARTTYPE) {
@@ -296,6 +510,11 @@ fs_init(struct fs *fs, FILE *fp, const struct options *opt, int verbose)
     if (fs_read_super(fs, verbose) < 0)
         return -1;
 
+    if (!opt->quick) {
+        cache_setup(fs, opt->cache_mb);
+        inode_cache_setup(fs);
+    }
+
     return 0;
 }
 
@@ -303,15 +522,91 @@ fs_init(struct fs *fs, FILE *fp, const struct options *opt, int verbose)
 
 /* ----- Inode access ----- */
 
+/*
+ * inode_table_off:
+ *   Byte offset of the start of the inode table.  The table starts
+ *   after:
+ *     block 0: boot
+ *     block 1: superblock
+ *     then i_blocks of inode bitmap,
+ *     then z_blocks of zone bitmap.
+ */
+static long
+inode_table_off(const struct fs *fs)
+{
+   uint32_t inode_table_block = 2 + fs->sb.i_blocks + fs->sb.z_blocks;
+
+   return fs->fs_offset + (long)inode_table_block * fs->blocksize;
+}
+
+/*
+ * inode_cache_setup:
+ *   Prepare the (lazy) inode slab cache: one pointer per blocksize
+ *   piece of the inode table, filled in on first touch.  The whole
+ *   table is only a few MB, so this is cheap to keep.  Skipped when
+ *   the image is mapped, since the mapping already serves inode
+ *   reads from memory.
+ */
+static void
+inode_cache_setup(struct fs *fs)
+{
+   uint32_t nslabs;
+
+   if (fs->map || fs->blocksize == 0) {
+       return;
+   }
+
+   nslabs = (fs->sb.ninodes * (uint32_t)sizeof(struct inode)
+             + fs->blocksize - 1) / fs->blocksize;
+   fs->islabs = calloc(nslabs, sizeof(unsigned char *));
+   if (!fs->islabs) {
+       return;             /* cache is best-effort */
+   }
+   fs->islab_count = nslabs;
+}
+
+/*
+ * fs_load_inode_table:
+ *   Bulk-load every slab of the inode table up front.  Worth it for
+ *   traversal-heavy workloads (-R, batch mode) that would otherwise
+ *   fault slabs in via scattered random reads.
+ */
+int
+fs_load_inode_table(struct fs *fs)
+{
+   uint32_t i;
+
+   if (!fs->islabs) {
+       return 0;           /* mapped or cache unavailable: nothing to do */
+   }
+   for (i = 0; i < fs->islab_count; i++) {
+       if (!fs->islabs[i]) {
+           fs->islabs[i] = malloc(fs->blocksize);
+           if (!fs->islabs[i]) {
+               return -1;
+           }
+           if (fs_read_at(fs, inode_table_off(fs)
+                          + (long)i * fs->blocksize,
+                          fs->islabs[i], fs->blocksize) != 0) {
+               free(fs->islabs[i]);
+               fs->islabs[i] = NULL;
+               return -1;
+           }
+       }
+   }
+   return 0;
+}
+
 /*
  * fs_get_inode:
- *   Load inode 'inum' from the inode table into *ino.
- *   Computes the inode table location from the superblock fields.
+ *   Load inode 'inum' from the inode table into *ino.  Served from
+ *   the inode slab cache when possible (loading the covering slab on
+ *   first touch), so directory listings stop paying one random read
+ *   per entry.
  */
 int
 fs_get_inode(const struct fs *fs, uint32_t inum, struct inode *ino)
 {
-   uint32_t inode_table_block;
    uint32_t idx;
    long     off;
 
@@ -322,32 +617,184 @@ fs_get_inode(const struct fs *fs, uint32_t inum, struct inode *ino)
    }
 
 
-   /* Inode table starts after:
-    *   block 0: boot
-    *   block 1: superblock
-    *   then i_blocks of inode bitmap,
-    *   then z_blocks of zone bitmap.
-    */
-   inode_table_block = 2 + fs->sb.i_blocks + fs->sb.z_blocks;
+   STAT_BUMP(fs, inode_loads, 1);
    idx = inum - 1;
+   off = inode_table_off(fs) + (long)idx * sizeof(struct inode);
+
+
+   if (fs->islabs) {
+       /* The slab cache is internal bookkeeping, like the zone
+        * cache: logically the fs stays const. */
+       struct fs *mfs = (struct fs *)fs;
+       uint32_t slab = idx * (uint32_t)sizeof(struct inode)
+                     / fs->blocksize;
+       uint32_t in_slab = idx * (uint32_t)sizeof(struct inode)
+                        % fs->blocksize;
+
+       if (slab < fs->islab_count) {
+           if (!mfs->islabs[slab]) {
+               mfs->islabs[slab] = malloc(fs->blocksize);
+               if (mfs->islabs[slab]) {
+                   if (fs_read_at(fs, inode_table_off(fs)
+                                  + (long)slab * fs->blocksize,
+                                  mfs->islabs[slab],
+                                  fs->blocksize) != 0) {
+                       free(mfs->islabs[slab]);
+                       mfs->islabs[slab] = NULL;
+                   }
+               }
+           }
+           if (mfs->islabs[slab]) {
+               memcpy(ino, mfs->islabs[slab] + in_slab, sizeof(*ino));
+               return 0;
+           }
+       }
+   }
+
+
+   if (fs_read_at(fs, off, ino, sizeof(*ino)) != 0) {
+       return -1;
+   }
+   return 0;
+}
+
 
+/* ----- Allocation bitmaps ----- */
 
-   off = fs->fs_offset
-       + (long)inode_table_block * fs->blocksize
-       + (long)idx * sizeof(struct inode);
+/*
+ * The inode bitmap (i_blocks blocks) and zone bitmap (z_blocks
+ * blocks) sit between the superblock and the inode table.  Bit 0 of
+ * each is reserved; zone bit n covers zone firstdata + n - 1.
+ * Nothing loads them by default: a corrupt or stale bitmap must not
+ * be able to change what extraction reads, so bitmap-aware hole
+ * skipping only kicks in after a caller opts in via fs_load_bitmaps.
+ */
 
+/*
+ * fs_load_bitmaps:
+ *   Read both allocation bitmaps into memory (a few KB even on large
+ *   images).  Idempotent.  Returns 0 on success, -1 on error.
+ */
+int
+fs_load_bitmaps(struct fs *fs)
+{
+   long   off = fs->fs_offset + 2L * fs->blocksize;
+   size_t isz = (size_t)fs->sb.i_blocks * fs->blocksize;
+   size_t zsz = (size_t)fs->sb.z_blocks * fs->blocksize;
 
-   if (fseek(fs->fp, off, SEEK_SET) != 0) {
-       perror("fseek inode");
+   if (fs->imap && fs->zmap) {
+       return 0;
+   }
+   if (isz == 0 || zsz == 0) {
+       fprintf(stderr, "superblock reports no bitmap blocks\n");
        return -1;
    }
-   if (fread(ino, sizeof(*ino), 1, fs->fp) != 1) {
-       perror("fread inode");
+   fs->imap = malloc(isz);
+   fs->zmap = malloc(zsz);
+   if (!fs->imap || !fs->zmap) {
+       fprintf(stderr, "malloc bitmaps\n");
+       free(fs->imap);
+       free(fs->zmap);
+       fs->imap = NULL;
+       fs->zmap = NULL;
+       return -1;
+   }
+   if (fs_read_at(fs, off, fs->imap, isz) != 0 ||
+       fs_read_at(fs, off + (long)isz, fs->zmap, zsz) != 0) {
+       free(fs->imap);
+       free(fs->zmap);
+       fs->imap = NULL;
+       fs->zmap = NULL;
        return -1;
    }
    return 0;
 }
 
+/*
+ * bitmap_count:
+ *   Number of set bits among the first 'nbits' bits of 'map'.
+ */
+static uint32_t
+bitmap_count(const unsigned char *map, uint32_t nbits)
+{
+   static const unsigned char nib[16] = {
+       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+   };
+   uint32_t count = 0;
+   uint32_t i;
+
+   for (i = 0; i + 8 <= nbits; i += 8) {
+       unsigned char b = map[i >> 3];
+
+       count += nib[b & 0x0f] + nib[b >> 4];
+   }
+   for (; i < nbits; i++) {
+       if (map[i >> 3] & (1 << (i & 7))) {
+           count++;
+       }
+   }
+   return count;
+}
+
+/*
+ * fs_zone_allocated:
+ *   Nonzero if the zone bitmap marks 'zone' as in use.  Without a
+ *   loaded bitmap every zone is assumed allocated, so callers can
+ *   consult this unconditionally.
+ */
+int
+fs_zone_allocated(const struct fs *fs, uint32_t zone)
+{
+   uint32_t bit;
+
+   if (!fs->zmap) {
+       return 1;
+   }
+   if (zone < fs->sb.firstdata || zone >= fs->sb.zones) {
+       return 0;
+   }
+   bit = zone - fs->sb.firstdata + 1;
+   return (fs->zmap[bit >> 3] >> (bit & 7)) & 1;
+}
+
+/*
+ * fs_print_usage:
+ *   Allocation report (-U): inode and zone utilization from the
+ *   bitmaps.  The reserved bit 0 of each map is excluded.
+ */
+void
+fs_print_usage(const struct fs *fs)
+{
+   uint32_t ibits = fs->sb.ninodes + 1;
+   uint32_t zbits = fs->sb.zones - fs->sb.firstdata + 1;
+   uint32_t iused;
+   uint32_t zused;
+
+   if (!fs->imap || !fs->zmap) {
+       fprintf(stderr, "bitmaps not loaded\n");
+       return;
+   }
+   iused = bitmap_count(fs->imap, ibits);
+   zused = bitmap_count(fs->zmap, zbits);
+   if (iused > 0) {
+       iused--;            /* reserved bit 0 */
+   }
+   if (zused > 0) {
+       zused--;
+   }
+
+   printf("inodes: %u used of %u (%.1f%%)\n",
+          iused, fs->sb.ninodes,
+          fs->sb.ninodes ? 100.0 * iused / fs->sb.ninodes : 0.0);
+   printf("zones:  %u used of %u (%.1f%%), zonesize %u\n",
+          zused, zbits - 1,
+          zbits > 1 ? 100.0 * zused / (zbits - 1) : 0.0,
+          fs->zonesize);
+   printf("data:   %lu bytes used, %lu bytes free\n",
+          (unsigned long)zused * fs->zonesize,
+          (unsigned long)(zbits - 1 - zused) * fs->zonesize);
+}
+
 
 /* ----- Type + permission helpers ----- */
 
@@ -393,16 +840,6 @@ fs_perm_string(const struct inode *ino, char *out)
    out[10] = '\0';
 }
 
-/*
- * scan_dir_zone:
- *   Scan up to 'to_read' bytes of directory entries starting at 'base'.
- *   If list_mode == 0, look for 'name' and return:
- *      1 on found (out_inum set),
- *      0 on not found,
- *     -1 on error.
- *   If list_mode == 1, ignore 'name' and print each non-empty entry.
- *   'remaining' is decremented by DIR_ENTRY_SIZE for each entry visited.
- */
 void
 fs_print_inode_verbose(const struct inode *ino)
 {
@@ -412,62 +849,101 @@ fs_print_inode_verbose(const struct inode *ino)
 }
 
 
-static int
-scan_dir_zone(const struct fs *fs,
-             long base,
-             uint32_t to_read,
-             const char *name,    /* may be NULL for fs_list_dir */
-             uint32_t *remaining,
-             uint32_t *out_inum,  /* ignored if name == NULL */
-             int list_mode)       /* 0 = lookup, 1 = list */
+/*
+ * fs_print_stats:
+ *   Dump the hot-path counters (-S) to stderr.  "mapped" images do
+ *   no raw reads at all, so reads/bytes staying at zero is expected
+ *   there.
+ */
+void
+fs_print_stats(const struct fs *fs)
 {
-   uint32_t offset = 0;
+   const struct fs_stats *st = &fs->stats;
 
+   fprintf(stderr,
+           "stats: reads=%lu bytes_read=%lu cache_hits=%lu "
+           "cache_misses=%lu\n"
+           "stats: zones_visited=%lu dirents_scanned=%lu "
+           "inode_loads=%lu index_hits=%lu%s\n",
+           st->reads, st->bytes_read, st->cache_hits, st->cache_misses,
+           st->zones_visited, st->dirents_scanned,
+           st->inode_loads, st->index_hits,
+           fs->map ? " (mapped)" : "");
+}
 
-   while (offset + DIR_ENTRY_SIZE <= to_read) {
-       struct dirent de;
-       long off = base + offset;
 
+/*
+ * Per-entry callback for dir_iterate: called with the NUL-terminated
+ * entry name and its inode number.  Return 0 to keep going, a
+ * positive value to stop early (propagated to the caller), or a
+ * negative value on error.
+ */
+typedef int (*dirent_fn)(const struct fs *fs, const char *name,
+                         uint32_t inum, void *arg);
+
+/*
+ * iterate_dir_zone:
+ *   Walk up to 'to_read' bytes of directory entries starting at
+ *   'base', calling 'fn' for each non-empty entry.  The zone is read
+ *   with one I/O (or borrowed zero-copy from the mapping).  With
+ *   'may_nest' set, 'fn' is allowed to issue its own reads, so the
+ *   zone cache cannot be borrowed from (eviction would invalidate
+ *   the scan buffer) and a private copy is used instead.
+ *   'remaining' is decremented by DIR_ENTRY_SIZE per entry visited.
+ */
+static int
+iterate_dir_zone(const struct fs *fs,
+                long base,
+                uint32_t to_read,
+                uint32_t *remaining,
+                dirent_fn fn,
+                void *arg,
+                int may_nest)
+{
+   uint32_t offset = 0;
+   const unsigned char *zone_buf;
+   unsigned char *owned = NULL;
 
-       if (fseek(fs->fp, off, SEEK_SET) != 0) {
-           perror("fseek dirent");
+
+   STAT_BUMP(fs, zones_visited, 1);
+   zone_buf = fs_data_ptr(fs, base, to_read);
+   if (!zone_buf && !may_nest) {
+       zone_buf = cache_borrow(fs, base, to_read);
+   }
+   if (!zone_buf) {
+       owned = malloc(to_read);
+       if (!owned) {
+           fprintf(stderr, "malloc dir zone\n");
            return -1;
        }
-       if (fread(&de, sizeof(de), 1, fs->fp) != 1) {
-           perror("fread dirent");
+       if (fs_read_at(fs, base, owned, to_read) != 0) {
+           free(owned);
            return -1;
        }
+       zone_buf = owned;
+   }
 
 
-       if (de.inode != 0) {
-           char dname[61];
-           memcpy(dname, de.name, 60);
-           dname[60] = '\0';
+   while (offset + DIR_ENTRY_SIZE <= to_read) {
+       const struct dirent *de =
+           (const struct dirent *)(zone_buf + offset);
 
 
-           if (!list_mode) {
-               /* lookup mode */
-               if (strcmp(dname, name) == 0) {
-                   if (out_inum) {
-                       *out_inum = de.inode;
-                   }
-                   return 1;  /* found */
-               }
-           } 
-           else {
-               /* list mode: print entry */
-               struct inode child;
-               char perm[11];
+       STAT_BUMP(fs, dirents_scanned, 1);
 
 
-               if (fs_get_inode(fs, de.inode, &child) < 0) {
-                   return -1;
-               }
-               fs_perm_string(&child, perm);
-               printf("%s %9u %s\n",
-                      perm,
-                      (unsigned)child.size,
-                      dname);
+       if (de->inode != 0) {
+           char dname[61];
+           int rc;
+
+           memcpy(dname, de->name, 60);
+           dname[60] = '\0';
+
+
+           rc = fn(fs, dname, de->inode, arg);
+           if (rc != 0) {
+               free(owned);
+               return rc;
            }
        }
 
@@ -481,30 +957,30 @@ scan_dir_zone(const struct fs *fs,
    }
 
 
-   return 0;  /* not found / done with this zone */
+   free(owned);
+   return 0;  /* done with this zone */
 }
 
 /*
- * dir_lookup:
- *   Search the directory inode 'dir_ino' for entry 'name'.
- *   Returns:
- *     1 if found (*out_inum set),
- *     0 if not found,
- *    -1 on error.
- *   Scans all direct zones, then any single-indirect zones.
+ * dir_iterate:
+ *   Call 'fn' for every non-empty entry of directory 'dir_ino',
+ *   covering direct zones and any single-indirect zones.  Stops and
+ *   propagates the first nonzero callback return (positive = early
+ *   stop, negative = error); returns 0 after a full scan.
  */
 static int
-dir_lookup(const struct fs *fs,
-          const struct inode *dir_ino,
-          const char *name,
-          uint32_t *out_inum)
+dir_iterate(const struct fs *fs,
+           const struct inode *dir_ino,
+           dirent_fn fn,
+           void *arg,
+           int may_nest)
 {
    uint32_t remaining = dir_ino->size;
    int i;
 
 
    if (!fs_is_dir(dir_ino)) {
-       fprintf(stderr, "dir_lookup on non-directory\n");
+       fprintf(stderr, "dir_iterate on non-directory\n");
        return -1;
    }
 
@@ -529,10 +1005,10 @@ dir_lookup(const struct fs *fs,
 
 
        {
-           int rc = scan_dir_zone(fs, base, to_read,
-                                  name, &remaining, out_inum, 0);
+           int rc = iterate_dir_zone(fs, base, to_read,
+                                     &remaining, fn, arg, may_nest);
            if (rc != 0) {
-               return rc;   /* 1 = found, -1 = error */
+               return rc;
            }
        }
    }
@@ -555,13 +1031,7 @@ dir_lookup(const struct fs *fs,
                + (long)dir_ino->indirect * fs->zonesize;
 
 
-           if (fseek(fs->fp, ind_off, SEEK_SET) != 0) {
-               perror("fseek dir indirect");
-               free(ind);
-               return -1;
-           }
-           if (fread(ind, 1, fs->zonesize, fs->fp) != fs->zonesize) {
-               perror("fread dir indirect");
+           if (fs_read_at(fs, ind_off, ind, fs->zonesize) != 0) {
                free(ind);
                return -1;
            }
@@ -588,8 +1058,8 @@ dir_lookup(const struct fs *fs,
 
 
            {
-               int rc = scan_dir_zone(fs, base, to_read,
-                                      name, &remaining, out_inum, 0);
+               int rc = iterate_dir_zone(fs, base, to_read,
+                                         &remaining, fn, arg, may_nest);
                if (rc != 0) {
                    free(ind);
                    return rc;
@@ -602,30 +1072,261 @@ dir_lookup(const struct fs *fs,
    }
 
 
-   *out_inum = 0;
-   return 0;  /* not found */
+   return 0;
 }
 
+/* ----- Hashed directory lookup ----- */
+
+/* Directories with at least this many entries get a name hash built
+ * on first lookup; smaller ones stay on the linear scan. */
+#define DIRHASH_MIN_ENTRIES 64
+
+/* How many directories keep a live hash at once (LRU replacement). */
+#define DIRHASH_DIRS 8
+
+struct dh_entry {
+   uint32_t inum;
+   uint32_t next;          /* chain: index + 1 into ents, 0 = end */
+   char     name[61];
+};
+
+struct fs_dirhash {
+   uint32_t key;           /* dir's first zone: unique per dir, 0 = empty */
+   unsigned long stamp;    /* LRU stamp (shares fs->cache_tick) */
+   uint32_t nbuckets;      /* power of two */
+   uint32_t *heads;        /* bucket -> entry index + 1, 0 = empty */
+   struct dh_entry *ents;
+   uint32_t nents;
+   uint32_t cap;
+};
+
+/* djb2; cheap and good enough for file names. */
+static uint32_t
+dh_hash(const char *s)
+{
+   uint32_t h = 5381;
 
+   while (*s) {
+       h = h * 33 + (unsigned char)*s++;
+   }
+   return h;
+}
 
+static void
+dh_clear(struct fs_dirhash *h)
+{
+   free(h->heads);
+   free(h->ents);
+   memset(h, 0, sizeof(*h));
+}
 
-/* canonicalize_path: treat NULL/"" as "/", strip extra slashes, etc. */
-void
-canonicalize_path(const char *in, char *out, size_t outsz)
+/* dir_iterate callback: append one entry to the hash under build. */
+static int
+dh_build_cb(const struct fs *fs, const char *name, uint32_t inum, void *arg)
 {
-   char tmp[1024];
-   size_t j = 0;
-   int last_was_slash = 0;
-   size_t i;
+   struct fs_dirhash *h = arg;
 
+   (void)fs;
+   if (h->nents == h->cap) {
+       struct dh_entry *tmp;
+       uint32_t ncap = h->cap ? h->cap * 2 : DIRHASH_MIN_ENTRIES;
 
-   if (!in || !*in) {
-       strncpy(out, "/", outsz);
-       out[outsz - 1] = '\0';
-       return;
+       tmp = realloc(h->ents, ncap * sizeof(*h->ents));
+       if (!tmp) {
+           return -1;
+       }
+       h->ents = tmp;
+       h->cap = ncap;
    }
+   h->ents[h->nents].inum = inum;
+   strcpy(h->ents[h->nents].name, name);
+   h->nents++;
+   return 0;
+}
+
+/*
+ * dirhash_get:
+ *   Return the lookup hash for 'dir_ino', building it with one
+ *   sequential scan if this is the first large-directory lookup (or
+ *   its LRU slot was recycled).  Directories are keyed by their first
+ *   zone, which is unique per directory, so no inode number is
+ *   needed.  Returns NULL if a hash cannot be built; callers then
+ *   fall back to the linear scan.
+ */
+static struct fs_dirhash *
+dirhash_get(const struct fs *cfs, const struct inode *dir_ino)
+{
+   struct fs *fs = (struct fs *)cfs;   /* caches are internal bookkeeping */
+   uint32_t key = dir_ino->zone[0];
+   struct fs_dirhash *h = NULL;
+   uint32_t i;
+   unsigned long oldest;
+
+   if (!fs->dirhash) {
+       fs->dirhash = calloc(DIRHASH_DIRS, sizeof(*fs->dirhash));
+       if (!fs->dirhash) {
+           return NULL;
+       }
+   }
+
+   for (i = 0; i < DIRHASH_DIRS; i++) {
+       if (fs->dirhash[i].key == key) {
+           fs->dirhash[i].stamp = ++fs->cache_tick;
+           return &fs->dirhash[i];
+       }
+   }
+
+   /* Miss: build into the LRU slot. */
+   oldest = (unsigned long)-1;
+   for (i = 0; i < DIRHASH_DIRS; i++) {
+       if (fs->dirhash[i].stamp < oldest) {
+           oldest = fs->dirhash[i].stamp;
+           h = &fs->dirhash[i];
+       }
+   }
+   dh_clear(h);
+
+   if (dir_iterate(fs, dir_ino, dh_build_cb, h, 0) < 0) {
+       dh_clear(h);
+       return NULL;
+   }
+
+   h->nbuckets = 1;
+   while (h->nbuckets < h->nents * 2) {
+       h->nbuckets *= 2;
+   }
+   h->heads = calloc(h->nbuckets, sizeof(*h->heads));
+   if (!h->heads) {
+       dh_clear(h);
+       return NULL;
+   }
+   for (i = 0; i < h->nents; i++) {
+       uint32_t b = dh_hash(h->ents[i].name) & (h->nbuckets - 1);
+
+       h->ents[i].next = h->heads[b];
+       h->heads[b] = i + 1;
+   }
+
+   h->key = key;
+   h->stamp = ++fs->cache_tick;
+   return h;
+}
+
+/*
+ * dirhash_free:
+ *   Release all per-directory hashes (fs_destroy helper).
+ */
+static void
+dirhash_free(struct fs *fs)
+{
+   uint32_t i;
+
+   if (!fs->dirhash) {
+       return;
+   }
+   for (i = 0; i < DIRHASH_DIRS; i++) {
+       dh_clear(&fs->dirhash[i]);
+   }
+   free(fs->dirhash);
+   fs->dirhash = NULL;
+}
+
+
+/* State for the lookup callback below. */
+struct lookup_ctx {
+   const char *name;
+   uint32_t inum;
+};
+
+static int
+lookup_cb(const struct fs *fs, const char *name, uint32_t inum, void *arg)
+{
+   struct lookup_ctx *ctx = arg;
+
+   (void)fs;
+   if (strcmp(name, ctx->name) == 0) {
+       ctx->inum = inum;
+       return 1;   /* found: stop iterating */
+   }
+   return 0;
+}
+
+/*
+ * dir_lookup:
+ *   Search the directory inode 'dir_ino' for entry 'name'.
+ *   Returns:
+ *     1 if found (*out_inum set),
+ *     0 if not found,
+ *    -1 on error.
+ */
+static int
+dir_lookup(const struct fs *fs,
+          const struct inode *dir_ino,
+          const char *name,
+          uint32_t *out_inum)
+{
+   struct lookup_ctx ctx;
+   int rc;
+
+
+   /* Large directory: serve the lookup from its name hash, built on
+    * first touch, instead of strcmp'ing across every dirent. */
+   if (dir_ino->size / DIR_ENTRY_SIZE >= DIRHASH_MIN_ENTRIES &&
+       dir_ino->zone[0] != 0) {
+       struct fs_dirhash *h = dirhash_get(fs, dir_ino);
+
+       if (h) {
+           uint32_t e = h->heads[dh_hash(name) & (h->nbuckets - 1)];
+
+           while (e != 0) {
+               if (strcmp(h->ents[e - 1].name, name) == 0) {
+                   *out_inum = h->ents[e - 1].inum;
+                   return 1;
+               }
+               e = h->ents[e - 1].next;
+           }
+           *out_inum = 0;
+           return 0;
+       }
+   }
+
+   ctx.name = name;
+   ctx.inum = 0;
+
+   rc = dir_iterate(fs, dir_ino, lookup_cb, &ctx, 0);
+   if (rc < 0) {
+       return -1;
+   }
+   if (rc > 0) {
+       *out_inum = ctx.inum;
+       return 1;
+   }
+
+
+   *out_inum = 0;
+   return 0;  /* not found */
+}
+
+
+
+
+/* canonicalize_path: treat NULL/"" as "/", strip extra slashes, etc. */
+void
+canonicalize_path(const char *in, char *out, size_t outsz)
+{
+   char tmp[1024];
+   size_t j = 0;
+   int last_was_slash = 0;
+   size_t i;
+
+
+   if (!in || !*in) {
+       strncpy(out, "/", outsz);
+       out[outsz - 1] = '\0';
+       return;
+   }
+
 
-
    /* Ensure leading '/', collapse duplicate '/' */
    if (in[0] != '/') {
        tmp[j++] = '/';
@@ -659,6 +1360,94 @@ canonicalize_path(const char *in, char *out, size_t outsz)
 }
 
 
+/* ----- Path-prefix cache ----- */
+
+/* How many resolved directory prefixes to remember (LRU).  Batch
+ * lists and daemon traffic hammer the same prefixes thousands of
+ * times; caching them skips the repeated top-of-tree lookups. */
+#define PCACHE_ENTRIES 64
+
+struct fs_pcache {
+   char path[1024];        /* canonical prefix, "" = empty slot */
+   uint32_t inum;
+   unsigned long stamp;    /* LRU stamp (shares fs->cache_tick) */
+};
+
+/*
+ * pcache_best:
+ *   Return the cached entry for the longest prefix of 'canon' that
+ *   ends on a component boundary, or NULL.
+ */
+static struct fs_pcache *
+pcache_best(const struct fs *cfs, const char *canon)
+{
+   struct fs *fs = (struct fs *)cfs;
+   struct fs_pcache *best = NULL;
+   size_t bestlen = 0;
+   int i;
+
+   if (!fs->pcache) {
+       return NULL;
+   }
+   for (i = 0; i < PCACHE_ENTRIES; i++) {
+       struct fs_pcache *e = &fs->pcache[i];
+       size_t len = strlen(e->path);
+
+       if (len <= bestlen || len == 0) {
+           continue;
+       }
+       if (strncmp(canon, e->path, len) == 0 &&
+           (canon[len] == '/' || canon[len] == '\0')) {
+           best = e;
+           bestlen = len;
+       }
+   }
+   if (best) {
+       best->stamp = ++fs->cache_tick;
+   }
+   return best;
+}
+
+/*
+ * pcache_put:
+ *   Remember that directory prefix 'prefix' resolves to 'inum',
+ *   recycling the LRU slot.  Allocates the cache on first use.
+ */
+static void
+pcache_put(const struct fs *cfs, const char *prefix, uint32_t inum)
+{
+   struct fs *fs = (struct fs *)cfs;
+   struct fs_pcache *victim = NULL;
+   unsigned long oldest = (unsigned long)-1;
+   int i;
+
+   if (strlen(prefix) >= sizeof(fs->pcache->path)) {
+       return;
+   }
+   if (!fs->pcache) {
+       fs->pcache = calloc(PCACHE_ENTRIES, sizeof(*fs->pcache));
+       if (!fs->pcache) {
+           return;
+       }
+   }
+   for (i = 0; i < PCACHE_ENTRIES; i++) {
+       struct fs_pcache *e = &fs->pcache[i];
+
+       if (strcmp(e->path, prefix) == 0) {
+           e->inum = inum;
+           e->stamp = ++fs->cache_tick;
+           return;
+       }
+       if (e->stamp < oldest) {
+           oldest = e->stamp;
+           victim = e;
+       }
+   }
+   strcpy(victim->path, prefix);
+   victim->inum = inum;
+   victim->stamp = ++fs->cache_tick;
+}
+
 /*
  * fs_find_path:
  *   Resolve 'path' starting from the root inode (1).
@@ -670,12 +1459,16 @@ fs_find_path(const struct fs *fs, const char *path,
             struct inode *ino, uint32_t *inum)
 {
    char canon[1024];
+   char orig[1024];
    char *token;
+   char *saveptr;
+   char *walk_from;
    struct inode cur;
    uint32_t cur_inum = 1;  /* root */
 
 
    canonicalize_path(path, canon, sizeof(canon));
+   strcpy(orig, canon);    /* tokenizing chops canon; keep it for prefixes */
 
 
    if (fs_get_inode(fs, cur_inum, &cur) < 0)
@@ -690,10 +1483,67 @@ fs_find_path(const struct fs *fs, const char *path,
    }
 
 
-   /* Walk each path component */
-   token = strtok(canon + 1, "/"); /* skip leading '/' */
+   /* Consult the path index sidecar, if one was loaded: O(log n)
+    * instead of a directory scan per component.  A miss falls
+    * through to the normal walk as a staleness safety net. */
+   if (fs->idx_count > 0) {
+       uint32_t lo = 0, hi = fs->idx_count;
+
+       while (lo < hi) {
+           uint32_t mid = lo + (hi - lo) / 2;
+           int cmp = strcmp(canon, fs->idx_paths + fs->idx_offs[mid]);
+
+           if (cmp == 0) {
+               if (fs_get_inode(fs, fs->idx_inums[mid], ino) < 0)
+                   return -1;
+               STAT_BUMP(fs, index_hits, 1);
+               *inum = fs->idx_inums[mid];
+               return 0;
+           }
+           if (cmp < 0) {
+               hi = mid;
+           }
+           else {
+               lo = mid + 1;
+           }
+       }
+   }
+
+
+   /* Start from the longest prefix already resolved this process,
+    * so repeated lookups under a shared directory skip the
+    * top-of-tree scans entirely. */
+   walk_from = canon + 1;
+   {
+       struct fs_pcache *hit = pcache_best(fs, canon);
+
+       if (hit) {
+           struct inode hino;
+
+           if (fs_get_inode(fs, hit->inum, &hino) == 0) {
+               size_t len = strlen(hit->path);
+
+               cur = hino;
+               cur_inum = hit->inum;
+               if (canon[len] == '\0') {
+                   *inum = cur_inum;
+                   *ino  = cur;
+                   return 0;
+               }
+               walk_from = canon + len + 1;
+           }
+       }
+   }
+
+
+   /* Walk each remaining path component.  strtok_r, not strtok: the
+    * -M sweep resolves paths from several threads at once, and
+    * strtok's process-global save pointer would silently cross wires
+    * between them. */
+   token = strtok_r(walk_from, "/", &saveptr);
    while (token != NULL) {
        uint32_t child_inum = 0;
+       size_t prefix_len;
        int rc;
 
 
@@ -717,7 +1567,18 @@ fs_find_path(const struct fs *fs, const char *path,
 
 
        cur_inum = child_inum;
-       token = strtok(NULL, "/");
+
+
+       /* Cache every directory prefix we pass through. */
+       prefix_len = (size_t)(token - canon) + strlen(token);
+       if (fs_is_dir(&cur)) {
+           char save = orig[prefix_len];
+
+           orig[prefix_len] = '\0';
+           pcache_put(fs, orig, cur_inum);
+           orig[prefix_len] = save;
+       }
+       token = strtok_r(NULL, "/", &saveptr);
    }
 
 
@@ -726,6 +1587,186 @@ fs_find_path(const struct fs *fs, const char *path,
    return 0;
 }
 
+/* ----- Buffered listing output ----- */
+
+/* Large -R listings spend their time in per-line printf format
+ * parsing and stdio locking rather than image I/O.  Listing lines
+ * are formatted by hand into this buffer and handed to stdio in big
+ * slabs; stdio still performs the final write, so output stays
+ * ordered with the printf headers and survives minixd's per-request
+ * stdout redirection.  Listing is single-threaded, so one static
+ * buffer suffices. */
+
+#define OUTBUF_SIZE (256 * 1024)
+
+static char   outbuf[OUTBUF_SIZE];
+static size_t outbuf_used;
+
+static void
+ob_flush(void)
+{
+   if (outbuf_used > 0) {
+       fwrite(outbuf, 1, outbuf_used, stdout);
+       outbuf_used = 0;
+   }
+}
+
+static void
+ob_put(const char *s, size_t n)
+{
+   if (outbuf_used + n > OUTBUF_SIZE) {
+       ob_flush();
+       if (n > OUTBUF_SIZE) {
+           /* Oversized piece: hand it straight to stdio. */
+           fwrite(s, 1, n, stdout);
+           return;
+       }
+   }
+   memcpy(outbuf + outbuf_used, s, n);
+   outbuf_used += n;
+}
+
+/*
+ * ob_uint:
+ *   Append 'v' in decimal, right-aligned in a field at least 'width'
+ *   characters wide (the "%9u" of the listing format, without the
+ *   format-string parsing).
+ */
+static void
+ob_uint(unsigned long v, int width)
+{
+   char tmp[24];
+   int i = (int)sizeof(tmp);
+
+   do {
+       tmp[--i] = (char)('0' + v % 10);
+       v /= 10;
+   } while (v != 0);
+   while ((int)sizeof(tmp) - i < width) {
+       tmp[--i] = ' ';
+   }
+   ob_put(tmp + i, sizeof(tmp) - (size_t)i);
+}
+
+
+/* Active listing name filter (-g), or NULL for no filtering.
+ * Listing is single-threaded, so one static suffices (see outbuf). */
+static const char *list_filter;
+
+/*
+ * glob_match:
+ *   Shell-style pattern match: '*' matches any run of characters,
+ *   '?' any single one, everything else itself.  Iterative with
+ *   single-star backtracking, so pathological patterns stay linear.
+ */
+static int
+glob_match(const char *pat, const char *name)
+{
+   const char *p = pat;
+   const char *n = name;
+   const char *star = NULL;
+   const char *star_n = NULL;
+
+   while (*n) {
+       if (*p == '?' || *p == *n) {
+           p++;
+           n++;
+       }
+       else if (*p == '*') {
+           star = p++;
+           star_n = n;
+       }
+       else if (star) {
+           p = star + 1;
+           n = ++star_n;
+       }
+       else {
+           return 0;
+       }
+   }
+   while (*p == '*') {
+       p++;
+   }
+   return *p == '\0';
+}
+
+/*
+ * fs_set_name_filter:
+ *   Install (or clear, with NULL) the glob pattern that listing
+ *   applies to entry names.  Matching happens against the raw dirent
+ *   name, before the entry's inode is ever loaded, so flat listings
+ *   of non-matching entries cost no inode reads at all.
+ */
+void
+fs_set_name_filter(const char *pattern)
+{
+   list_filter = pattern;
+}
+
+
+/* State for the list callback: prints entries and (in tree mode)
+ * remembers subdirectories to recurse into afterwards. */
+struct list_ctx {
+   struct {
+       char name[61];
+       uint32_t inum;
+   } *subdirs;
+   size_t n;
+   size_t cap;
+   int collect;        /* nonzero: remember subdirectories */
+};
+
+static int
+list_cb(const struct fs *fs, const char *name, uint32_t inum, void *arg)
+{
+   struct list_ctx *ctx = arg;
+   struct inode child;
+   char perm[11];
+   int matched = !list_filter || glob_match(list_filter, name);
+
+
+   if (!matched && !ctx->collect) {
+       /* Flat listing: a filtered-out name needs no inode at all.
+        * Tree mode still loads it below, because MINIX dirents carry
+        * no type byte and subdirectories must be descended into
+        * whether or not their names match. */
+       return 0;
+   }
+   if (fs_get_inode(fs, inum, &child) < 0) {
+       return -1;
+   }
+   if (matched) {
+       fs_perm_string(&child, perm);
+       ob_put(perm, 10);
+       ob_put(" ", 1);
+       ob_uint(child.size, 9);
+       ob_put(" ", 1);
+       ob_put(name, strlen(name));
+       ob_put("\n", 1);
+   }
+
+
+   if (ctx->collect && fs_is_dir(&child) &&
+       strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+       if (ctx->n == ctx->cap) {
+           void *tmp;
+           size_t ncap = ctx->cap ? ctx->cap * 2 : 16;
+
+           tmp = realloc(ctx->subdirs, ncap * sizeof(*ctx->subdirs));
+           if (!tmp) {
+               fprintf(stderr, "realloc subdir list\n");
+               return -1;
+           }
+           ctx->subdirs = tmp;
+           ctx->cap = ncap;
+       }
+       strcpy(ctx->subdirs[ctx->n].name, name);
+       ctx->subdirs[ctx->n].inum = inum;
+       ctx->n++;
+   }
+   return 0;
+}
+
 /*
  * fs_list_dir:
  *   List the contents of directory inode 'dir_ino' in long format.
@@ -735,105 +1776,1231 @@ int
 fs_list_dir(const struct fs *fs, const char *path,
            const struct inode *dir_ino)
 {
-   uint32_t remaining = dir_ino->size;
-   int i;
+   struct list_ctx ctx;
 
 
    (void)path;
 
 
-   if (!fs_is_dir(dir_ino)) {
-       fprintf(stderr, "fs_list_dir called on non-directory\n");
+   memset(&ctx, 0, sizeof(ctx));
+   if (dir_iterate(fs, dir_ino, list_cb, &ctx, 1) < 0) {
+       ob_flush();
        return -1;
    }
+   ob_flush();
+   return 0;
+}
 
-
-   /* 1) Direct zones */
-   for (i = 0; i < DIRECT_ZONES && remaining > 0; i++) {
-       uint32_t z = dir_ino->zone[i];
-       long base;
-       uint32_t to_read;
+/*
+ * list_tree_rec:
+ *   Recursion body of fs_list_tree.  Output accumulates in the
+ *   listing buffer; the public wrapper flushes it once at the end so
+ *   deep trees do not pay a write per directory.
+ */
+static int
+list_tree_rec(const struct fs *fs, const char *path,
+              const struct inode *dir_ino)
+{
+   struct list_ctx ctx;
+   size_t i;
+   int rc = 0;
 
 
-       if (z == 0) {
-           uint32_t skip = fs->zonesize;
-           if (remaining <= skip) break;
-           remaining -= skip;
-           continue;
-       }
+   memset(&ctx, 0, sizeof(ctx));
+   ctx.collect = 1;
 
 
-       base = fs->fs_offset + (long)z * fs->zonesize;
-       to_read = (remaining < fs->zonesize) ? remaining : fs->zonesize;
+   ob_put(path, strlen(path));
+   ob_put(":\n", 2);
+   if (dir_iterate(fs, dir_ino, list_cb, &ctx, 1) < 0) {
+       rc = -1;
+   }
 
 
-       if (scan_dir_zone(fs, base, to_read,
-                         NULL, &remaining, NULL, 1) < 0) {
-           return -1;
-       }
-   }
+   for (i = 0; rc == 0 && i < ctx.n; i++) {
+       char childpath[1024];
+       struct inode child;
+       size_t plen = strlen(path);
 
 
-   /* 2) Single-indirect zones */
-   if (remaining > 0 && dir_ino->indirect != 0) {
-       uint32_t nentries = fs->zonesize / sizeof(uint32_t);
-       uint32_t *ind = malloc(fs->zonesize);
+       if (plen + strlen(ctx.subdirs[i].name) + 2 > sizeof(childpath)) {
+           fprintf(stderr, "path too long, skipping %s\n",
+                   ctx.subdirs[i].name);
+           continue;
+       }
+       if (strcmp(path, "/") == 0) {
+           sprintf(childpath, "/%s", ctx.subdirs[i].name);
+       }
+       else {
+           sprintf(childpath, "%s/%s", path, ctx.subdirs[i].name);
+       }
 
 
-       if (!ind) {
-           fprintf(stderr, "malloc indirect\n");
-           return -1;
+       if (fs_get_inode(fs, ctx.subdirs[i].inum, &child) < 0) {
+           rc = -1;
+           break;
        }
+       ob_put("\n", 1);
+       if (list_tree_rec(fs, childpath, &child) < 0) {
+           rc = -1;
+       }
+   }
 
 
-       {
-           long ind_off = fs->fs_offset
-               + (long)dir_ino->indirect * fs->zonesize;
+   free(ctx.subdirs);
+   return rc;
+}
 
+/*
+ * fs_list_tree:
+ *   Recursively list directory 'dir_ino' (at 'path') and everything
+ *   below it, ls -R style: each directory prints a "path:" header and
+ *   its entries, then its subdirectories follow.  The whole tree is
+ *   walked in this one process, so loaded zones and cached inodes are
+ *   reused instead of re-resolving from the root per directory.
+ */
+int
+fs_list_tree(const struct fs *fs, const char *path,
+            const struct inode *dir_ino)
+{
+   int rc = list_tree_rec(fs, path, dir_ino);
 
-           if (fseek(fs->fp, ind_off, SEEK_SET) != 0) {
-               perror("fseek dir indirect");
-               free(ind);
-               return -1;
-           }
-           if (fread(ind, 1, fs->zonesize, fs->fp) != fs->zonesize) {
-               perror("fread dir indirect");
-               free(ind);
-               return -1;
-           }
+   ob_flush();
+   return rc;
+}
+
+
+/* Context for one directory level of a generic tree walk. */
+struct walk_ctx {
+   fs_walk_fn cb;
+   void *arg;
+   const char *path;        /* path of the directory being walked */
+};
+
+static int
+walk_entry_cb(const struct fs *fs, const char *name, uint32_t inum,
+              void *arg)
+{
+   struct walk_ctx *ctx = arg;
+   struct inode child;
+   char childpath[1024];
+   size_t plen = strlen(ctx->path);
+   int rc;
+
+   if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+       return 0;
+   }
+   if (plen + strlen(name) + 2 > sizeof(childpath)) {
+       fprintf(stderr, "path too long, skipping %s\n", name);
+       return 0;
+   }
+   if (strcmp(ctx->path, "/") == 0) {
+       sprintf(childpath, "/%s", name);
+   }
+   else {
+       sprintf(childpath, "%s/%s", ctx->path, name);
+   }
+
+   if (fs_get_inode(fs, inum, &child) < 0) {
+       return -1;
+   }
+   rc = ctx->cb(fs, childpath, &child, inum, ctx->arg);
+   if (rc != 0) {
+       return rc;
+   }
+
+   if (fs_is_dir(&child)) {
+       struct walk_ctx sub;
+
+       sub.cb = ctx->cb;
+       sub.arg = ctx->arg;
+       sub.path = childpath;
+       if (dir_iterate(fs, &child, walk_entry_cb, &sub, 1) < 0) {
+           return -1;
        }
+   }
+   return 0;
+}
 
+/*
+ * fs_walk_tree:
+ *   Depth-first walk of the whole tree from the root, calling 'cb'
+ *   once for every entry (directories included, root excluded) with
+ *   its full path.  Returns 0 on success, -1 on error or if 'cb'
+ *   aborted the walk.
+ */
+int
+fs_walk_tree(const struct fs *fs, fs_walk_fn cb, void *arg)
+{
+   struct inode root;
+   struct walk_ctx ctx;
 
-       for (i = 0; i < (int)nentries && remaining > 0; i++) {
-           uint32_t z = ind[i];
-           long base;
-           uint32_t to_read;
+   if (fs_get_inode(fs, 1, &root) < 0) {
+       return -1;
+   }
+   ctx.cb = cb;
+   ctx.arg = arg;
+   ctx.path = "/";
+   return dir_iterate(fs, &root, walk_entry_cb, &ctx, 1) < 0 ? -1 : 0;
+}
 
 
-           if (z == 0) {
-               uint32_t skip = fs->zonesize;
-               if (remaining <= skip) break;
-               remaining -= skip;
-               continue;
-           }
+/* ----- Extent mapping ----- */
 
+/*
+ * table_read:
+ *   Read an indirect-table block for the extent walker.  Worker
+ *   threads pass their own descriptor so the read goes through pread
+ *   (positionless); fd < 0 takes the normal fs_read_at path.
+ */
+static int
+table_read(const struct fs *fs, int fd, long off, void *buf, size_t len)
+{
+    if (fd >= 0 && !fs->map) {
+        size_t done = 0;
+
+        while (done < len) {
+            ssize_t n = pread(fd, (char *)buf + done, len - done,
+                              off + (long)done);
+
+            if (n <= 0) {
+                perror("pread table");
+                return -1;
+            }
+            done += (size_t)n;
+        }
+        return 0;
+    }
+    return fs_read_at(fs, off, buf, len);
+}
 
-           base = fs->fs_offset + (long)z * fs->zonesize;
-           to_read = (remaining < fs->zonesize)
-                   ? remaining : fs->zonesize;
+/*
+ * fs_map_extents:
+ *   Walk the zone pointers of 'ino' (direct, single-indirect, and
+ *   double-indirect) exactly once and hand 'cb' maximal coalesced
+ *   runs of bytes that are contiguous on disk, holes included.  A
+ *   mostly contiguously allocated file thus maps to a handful of
+ *   large extents instead of one callback per block.
+ *   'fd' is passed through to table reads for thread-safe use
+ *   (pass -1 normally).  Returns 0 on success, -1 on error.
+ */
+int
+fs_map_extents(const struct fs *fs, int fd, const struct inode *ino,
+               fs_extent_fn cb, void *arg)
+{
+    uint32_t remaining = ino->size;
+    uint32_t entries_per_ind = fs->blocksize / sizeof(uint32_t);
+    uint32_t block_index = 0;
+    uint32_t *ind1 = NULL;      /* single-indirect table (if present) */
+    uint32_t *dbl1 = NULL;      /* first-level double-indirect table */
+    uint32_t *dbl2 = NULL;      /* cached second-level table */
+    uint32_t dbl2_index = (uint32_t)-1;
+    size_t   ind_bytes = fs->blocksize;
+    struct fs_extent cur;
+    int have_cur = 0;
+    int rc = -1;
+
+    /* Load the indirect tables up front (first block of each zone). */
+    if (ino->indirect != 0) {
+        long off = fs->fs_offset + (long)ino->indirect * fs->zonesize;
+
+        ind1 = malloc(ind_bytes);
+        if (!ind1) {
+            fprintf(stderr, "malloc indirect\n");
+            goto done;
+        }
+        if (table_read(fs, fd, off, ind1, ind_bytes) != 0) {
+            goto done;
+        }
+    }
+    if (ino->two_indirect != 0) {
+        long off = fs->fs_offset + (long)ino->two_indirect * fs->zonesize;
+
+        dbl1 = malloc(ind_bytes);
+        if (!dbl1) {
+            fprintf(stderr, "malloc two_indirect\n");
+            goto done;
+        }
+        if (table_read(fs, fd, off, dbl1, ind_bytes) != 0) {
+            goto done;
+        }
+    }
 
+    while (remaining > 0) {
+        uint32_t zone = 0;
+        uint32_t len;
+        long off;
 
-           if (scan_dir_zone(fs, base, to_read,
-                             NULL, &remaining, NULL, 1) < 0) {
-               free(ind);
+        if (block_index < DIRECT_ZONES) {
+            zone = ino->zone[block_index];
+        }
+        else if (block_index < DIRECT_ZONES + entries_per_ind) {
+            if (ind1) {
+                zone = ind1[block_index - DIRECT_ZONES];
+            }
+        }
+        else {
+            uint32_t idx2 = block_index - DIRECT_ZONES - entries_per_ind;
+            uint32_t l1 = idx2 / entries_per_ind;
+            uint32_t l2 = idx2 % entries_per_ind;
+
+            if (l1 >= entries_per_ind) {
+                break;  /* beyond double-indirect reach */
+            }
+            if (dbl1 && dbl1[l1] != 0) {
+                if (dbl2_index != l1) {
+                    long l2_off = fs->fs_offset
+                        + (long)dbl1[l1] * fs->zonesize;
+
+                    if (!dbl2) {
+                        dbl2 = malloc(ind_bytes);
+                        if (!dbl2) {
+                            fprintf(stderr, "malloc dbl2\n");
+                            goto done;
+                        }
+                    }
+                    if (table_read(fs, fd, l2_off, dbl2, ind_bytes) != 0) {
+                        goto done;
+                    }
+                    dbl2_index = l1;
+                }
+                zone = dbl2[l2];
+            }
+        }
+
+        if (zone != 0 && fs->zmap && !fs_zone_allocated(fs, zone)) {
+            /* The (explicitly loaded) zone bitmap marks this zone
+             * free: treat the pointer as a hole. */
+            zone = 0;
+        }
+
+        len = (remaining < fs->zonesize) ? remaining : fs->zonesize;
+        off = zone ? fs->fs_offset + (long)zone * fs->zonesize : 0;
+
+        if (have_cur &&
+            cur.hole == (zone == 0) &&
+            (cur.hole || cur.off + (long)cur.len == off)) {
+            /* Extends the current run. */
+            cur.len += len;
+        }
+        else {
+            if (have_cur && cb(fs, &cur, arg) < 0) {
+                goto done;
+            }
+            cur.off = off;
+            cur.len = len;
+            cur.hole = (zone == 0);
+            have_cur = 1;
+        }
+
+        remaining -= len;
+        block_index++;
+    }
+
+    if (have_cur && cb(fs, &cur, arg) < 0) {
+        goto done;
+    }
+
+    if (remaining != 0) {
+        fprintf(stderr,
+                "Warning: file has %u more bytes than a double-indirect "
+                "file can address\n",
+                remaining);
+        goto done;
+    }
+
+    rc = 0;
+
+done:
+    free(ind1);
+    free(dbl1);
+    free(dbl2);
+    return rc;
+}
+
+
+/* ----- File copy engine ----- */
+
+/*
+ * engine_read:
+ *   Read for the copy engine.  With fd >= 0 the read goes through
+ *   pread on that descriptor (positionless, so safe from worker
+ *   threads that cannot share the stateful FILE* in struct fs);
+ *   otherwise it falls through to fs_read_at.
+ */
+static int
+engine_read(const struct fs *fs, int fd, long off, void *buf, size_t len)
+{
+   if (fd >= 0 && !fs->map) {
+       size_t done = 0;
+
+       while (done < len) {
+           ssize_t n = pread(fd, (char *)buf + done, len - done,
+                             off + (long)done);
+
+           if (n <= 0) {
+               perror("pread image");
                return -1;
            }
+           done += (size_t)n;
        }
+       return 0;
+   }
+   return fs_read_at(fs, off, buf, len);
+}
 
+/* ----- Checksums ----- */
 
-       free(ind);
-   }
+/*
+ * fs_crc32:
+ *   Standard CRC-32 (IEEE, reflected, zlib-compatible), table-driven.
+ *   Pass 0 to start; feed chunks in order.  Kept portable: a
+ *   byte-at-a-time table lookup keeps up with our I/O rates and
+ *   builds everywhere this tree builds.
+ */
+uint32_t
+fs_crc32(uint32_t crc, const void *buf, size_t len)
+{
+    static uint32_t table[256];
+    static int have_table = 0;
+    const unsigned char *p = buf;
+    size_t i;
+
+    if (!have_table) {
+        uint32_t j, c;
+        int k;
+
+        for (j = 0; j < 256; j++) {
+            c = j;
+            for (k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320UL ^ (c >> 1) : (c >> 1);
+            }
+            table[j] = c;
+        }
+        have_table = 1;
+    }
+
+    crc = ~crc;
+    for (i = 0; i < len; i++) {
+        crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
 
 
-   return 0;
+/* State shared by the extent copy callback below. */
+struct copy_ctx {
+    int   fd;          /* per-worker descriptor, or -1 */
+    FILE *out;
+    int   sparse;      /* holes may be seeked over */
+    unsigned char *buf;   /* copy buffer, allocated once per file */
+    size_t bufsz;
+    int   zc;          /* zero-copy state: 0 try, 1 splice, 2 sendfile,
+                        * -1 disabled (buffered path) */
+    uint32_t *crc;     /* running CRC-32 of the file bytes, or NULL */
+};
+
+#ifdef __linux__
+/*
+ * zc_write_extent:
+ *   Move one data extent from the image descriptor to the output
+ *   kernel-side: splice when the output is a pipe, sendfile
+ *   otherwise, remembering which one worked for the rest of the
+ *   file.  Returns 0 when the extent was fully written, 1 when
+ *   zero-copy is unsupported here and nothing was written (caller
+ *   falls back to the buffered path for good), -1 on a hard error.
+ */
+static int
+zc_write_extent(const struct fs *fs, struct copy_ctx *ctx,
+                long off, uint32_t left)
+{
+    int in_fd = (ctx->fd >= 0) ? ctx->fd : fs->fd;
+    int out_fd;
+    off_t o = (off_t)off;
+    size_t done = 0;
+
+    if (in_fd < 0) {
+        ctx->zc = -1;
+        return 1;
+    }
+    /* Raw writes bypass stdio; anything buffered must go out first. */
+    if (fflush(ctx->out) != 0) {
+        perror("fflush out");
+        return -1;
+    }
+    out_fd = fileno(ctx->out);
+
+    while (done < left) {
+        ssize_t n;
+
+        if (ctx->zc == 2) {
+            n = sendfile(out_fd, in_fd, &o, left - done);
+        }
+        else {
+            n = splice(in_fd, &o, out_fd, NULL, left - done,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+        }
+        if (n > 0) {
+            if (ctx->zc == 0) {
+                ctx->zc = 1;
+            }
+            done += (size_t)n;
+            continue;
+        }
+
+        if (done == 0 && ctx->zc == 0 &&
+            (errno == EINVAL || errno == ENOSYS)) {
+            /* Not a pipe: try sendfile once before giving up. */
+            n = sendfile(out_fd, in_fd, &o, left);
+            if (n > 0) {
+                ctx->zc = 2;
+                done += (size_t)n;
+                continue;
+            }
+            ctx->zc = -1;
+            return 1;
+        }
+        if (done == 0) {
+            ctx->zc = -1;
+            return 1;
+        }
+        perror("splice/sendfile");
+        return -1;
+    }
+    return 0;
+}
+#endif /* __linux__ */
+
+/*
+ * copy_extent_cb:
+ *   Write one on-disk extent of the source file to the output.  Data
+ *   extents are written straight from the mapping when available, or
+ *   pulled through the per-file copy buffer (-w, default 4 MB) so a
+ *   contiguous run costs one read and one fwrite per buffer-full
+ *   rather than round trips at some small fixed size; holes are
+ *   seeked over (sparse destinations) or zero-filled.
+ */
+static int
+copy_extent_cb(const struct fs *fs, const struct fs_extent *ext, void *arg)
+{
+    struct copy_ctx *ctx = arg;
+    long off = ext->off;
+    uint32_t left = ext->len;
+
+    if (ext->hole) {
+        if (ctx->sparse) {
+            /* Skip the hole; the final ftruncate sets the length.
+             * Holes still count as zeros for the checksum. */
+            if (ctx->crc) {
+                uint32_t cleft = left;
+
+                memset(ctx->buf, 0, ctx->bufsz);
+                while (cleft > 0) {
+                    uint32_t chunk = (cleft < ctx->bufsz)
+                                   ? cleft : (uint32_t)ctx->bufsz;
+
+                    *ctx->crc = fs_crc32(*ctx->crc, ctx->buf, chunk);
+                    cleft -= chunk;
+                }
+            }
+            if (fseek(ctx->out, (long)left, SEEK_CUR) != 0) {
+                perror("fseek hole");
+                return -1;
+            }
+            return 0;
+        }
+        memset(ctx->buf, 0, ctx->bufsz);
+        while (left > 0) {
+            uint32_t chunk = (left < ctx->bufsz)
+                           ? left : (uint32_t)ctx->bufsz;
+
+            if (fwrite(ctx->buf, 1, chunk, ctx->out) != chunk) {
+                perror("fwrite hole");
+                return -1;
+            }
+            if (ctx->crc) {
+                *ctx->crc = fs_crc32(*ctx->crc, ctx->buf, chunk);
+            }
+            left -= chunk;
+        }
+        return 0;
+    }
+
+#ifdef __linux__
+    if (ctx->zc >= 0) {
+        int rc = zc_write_extent(fs, ctx, off, left);
+
+        if (rc <= 0) {
+            return rc;
+        }
+        /* rc == 1: zero-copy unsupported here; buffered from now on. */
+    }
+#endif
+
+    {
+        const void *src = fs_data_ptr(fs, off, left);
+
+        if (src) {
+            /* Mapped image: one write per extent, zero copies. */
+            if (fwrite(src, 1, left, ctx->out) != left) {
+                perror("fwrite out");
+                return -1;
+            }
+            if (ctx->crc) {
+                *ctx->crc = fs_crc32(*ctx->crc, src, left);
+            }
+            return 0;
+        }
+    }
+
+    while (left > 0) {
+        uint32_t chunk = (left < ctx->bufsz)
+                       ? left : (uint32_t)ctx->bufsz;
+
+        if (engine_read(fs, ctx->fd, off, ctx->buf, chunk) != 0) {
+            return -1;
+        }
+        if (fwrite(ctx->buf, 1, chunk, ctx->out) != chunk) {
+            perror("fwrite out");
+            return -1;
+        }
+        if (ctx->crc) {
+            *ctx->crc = fs_crc32(*ctx->crc, ctx->buf, chunk);
+        }
+        off  += chunk;
+        left -= chunk;
+    }
+
+    return 0;
+}
+
+/* Growable extent list, filled by collect_extent_cb. */
+struct extent_list {
+    struct fs_extent *v;
+    size_t n;
+    size_t cap;
+};
+
+static int
+collect_extent_cb(const struct fs *fs, const struct fs_extent *ext,
+                  void *arg)
+{
+    struct extent_list *list = arg;
+
+    (void)fs;
+    if (list->n == list->cap) {
+        struct fs_extent *tmp;
+        size_t ncap = list->cap ? list->cap * 2 : 16;
+
+        tmp = realloc(list->v, ncap * sizeof(*list->v));
+        if (!tmp) {
+            fprintf(stderr, "realloc extent list\n");
+            return -1;
+        }
+        list->v = tmp;
+        list->cap = ncap;
+    }
+    list->v[list->n++] = *ext;
+    return 0;
+}
+
+/*
+ * prefetch_extents:
+ *   Tell the kernel which image ranges the copy loop is about to
+ *   read, so readahead overlaps with our output writes instead of
+ *   the disk idling during every fwrite.  Purely advisory; failures
+ *   are ignored.
+ */
+static void
+prefetch_extents(const struct fs *fs, int fd,
+                 const struct extent_list *list)
+{
+    size_t i;
+    long pagesz = sysconf(_SC_PAGESIZE);
+
+    if (fd < 0) {
+        fd = fileno(fs->fp);
+    }
+
+    for (i = 0; i < list->n; i++) {
+        const struct fs_extent *ext = &list->v[i];
+
+        if (ext->hole) {
+            continue;
+        }
+        if (fs->map) {
+            /* posix_madvise wants a page-aligned start. */
+            long a = ext->off - (ext->off % pagesz);
+
+            posix_madvise((void *)(fs->map + a),
+                          (size_t)(ext->off - a) + ext->len,
+                          POSIX_MADV_WILLNEED);
+        }
+        else if (fd >= 0) {
+            posix_fadvise(fd, ext->off, ext->len, POSIX_FADV_WILLNEED);
+        }
+    }
+}
+
+/*
+ * fs_copy_file_crc:
+ *   Copy the contents of 'ino' to 'out'.  The zone tables are walked
+ *   once by fs_map_extents, which hands back coalesced contiguous
+ *   runs, so a well-allocated file is copied with a few large reads
+ *   instead of one read per block.  The extent list is prefetched
+ *   before the copy loop starts so image reads and output writes
+ *   overlap.  Workers pass their own fd so all reads stay
+ *   thread-safe.  With 'crc' non-NULL the CRC-32 of the file is
+ *   accumulated into it while the bytes are hot, for one-pass
+ *   verified extraction.
+ */
+int
+fs_copy_file_crc(const struct fs *fs,
+                 int fd,
+                 const struct inode *ino,
+                 FILE *out,
+                 uint32_t *crc)
+{
+    struct copy_ctx ctx;
+    struct extent_list list;
+    size_t i;
+    int rc = 0;
+
+    ctx.fd = fd;
+    ctx.out = out;
+    ctx.sparse = 0;
+    ctx.crc = crc;
+    if (crc) {
+        *crc = 0;
+    }
+
+    /* Zero-copy is only attempted when streaming to stdout (the
+     * pipe-into-consumer case it exists for); regular-file output
+     * keeps the sparse-aware buffered path.  Checksumming needs the
+     * bytes in user space, so it forces the buffered path too. */
+#ifdef __linux__
+    ctx.zc = (out == stdout && !crc) ? 0 : -1;
+#else
+    ctx.zc = -1;
+#endif
+
+    /* One buffer per file, sized by -w but never bigger than the
+     * file itself (rounded up to a whole zone) and never smaller
+     * than one zone.  Halve on malloc failure rather than giving up:
+     * a smaller buffer is slower, not wrong. */
+    ctx.bufsz = fs->copybuf_bytes;
+    if ((uint32_t)ctx.bufsz > ino->size + fs->zonesize) {
+        ctx.bufsz = ino->size + fs->zonesize
+                  - (ino->size % fs->zonesize);
+    }
+    if (ctx.bufsz < fs->zonesize) {
+        ctx.bufsz = fs->zonesize;
+    }
+    while ((ctx.buf = malloc(ctx.bufsz)) == NULL) {
+        if (ctx.bufsz <= fs->zonesize) {
+            fprintf(stderr, "malloc copy buffer\n");
+            return -1;
+        }
+        ctx.bufsz /= 2;
+    }
+
+    /* Holes can be seeked over (instead of writing zeros) when the
+     * destination is a regular file we opened ourselves; stdout may
+     * be a pipe or an appended log, so it always gets real zeros. */
+    if (out != stdout) {
+        struct stat st;
+
+        if (fstat(fileno(out), &st) == 0 && S_ISREG(st.st_mode)) {
+            ctx.sparse = 1;
+        }
+    }
+
+    memset(&list, 0, sizeof(list));
+    if (fs_map_extents(fs, fd, ino, collect_extent_cb, &list) < 0) {
+        free(list.v);
+        free(ctx.buf);
+        return -1;
+    }
+
+    prefetch_extents(fs, fd, &list);
+
+    for (i = 0; i < list.n; i++) {
+        if (copy_extent_cb(fs, &list.v[i], &ctx) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+    free(list.v);
+    free(ctx.buf);
+    if (rc < 0) {
+        return -1;
+    }
+
+    /* A trailing hole leaves the file position past EOF without any
+     * write; ftruncate pins the destination to the true length. */
+    if (ctx.sparse) {
+        if (fflush(out) != 0 ||
+            ftruncate(fileno(out), (off_t)ino->size) != 0) {
+            perror("ftruncate dstpath");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int
+fs_copy_file(const struct fs *fs, int fd, const struct inode *ino,
+             FILE *out)
+{
+    return fs_copy_file_crc(fs, fd, ino, out, NULL);
+}
+
+int
+fs_copy_file_to_stream(const struct fs *fs,
+                       const struct inode *ino,
+                       FILE *out)
+{
+    return fs_copy_file_crc(fs, -1, ino, out, NULL);
+}
+
+
+/* ----- Random-access file handles ----- */
+
+/*
+ * file_from_inode:
+ *   Build a read handle for 'ino': map its extents once and record
+ *   the file offset where each extent starts, so positional reads
+ *   can binary-search straight to the covering zones.
+ */
+static struct fs_file *
+file_from_inode(const struct fs *fs, const struct inode *ino)
+{
+    struct fs_file *f;
+    struct extent_list list;
+    long foff;
+    size_t i;
+
+    f = malloc(sizeof(*f));
+    if (!f) {
+        fprintf(stderr, "malloc file handle\n");
+        return NULL;
+    }
+    memset(f, 0, sizeof(*f));
+    f->fs = fs;
+    f->ino = *ino;
+
+    memset(&list, 0, sizeof(list));
+    if (fs_map_extents(fs, -1, ino, collect_extent_cb, &list) < 0) {
+        free(list.v);
+        free(f);
+        return NULL;
+    }
+    f->ext = list.v;
+    f->next = list.n;
+
+    f->foffs = malloc((list.n ? list.n : 1) * sizeof(*f->foffs));
+    if (!f->foffs) {
+        fprintf(stderr, "malloc file offsets\n");
+        fs_close(f);
+        return NULL;
+    }
+    foff = 0;
+    for (i = 0; i < f->next; i++) {
+        f->foffs[i] = foff;
+        foff += (long)f->ext[i].len;
+    }
+    return f;
+}
+
+/*
+ * fs_open:
+ *   Open 'path' for positional reads.  Rejects non-regular files.
+ *   Returns NULL on error.
+ */
+struct fs_file *
+fs_open(const struct fs *fs, const char *path)
+{
+    struct inode ino;
+    uint32_t inum;
+
+    if (fs_find_path(fs, path, &ino, &inum) < 0) {
+        return NULL;
+    }
+    if (!fs_is_regular(&ino)) {
+        fprintf(stderr, "%s is not a regular file.\n", path);
+        return NULL;
+    }
+    return file_from_inode(fs, &ino);
+}
+
+/*
+ * fs_file_read:
+ *   Read up to 'len' bytes at byte 'offset' of the open file into
+ *   'buf'.  Holes read as zeros.  Returns the number of bytes read
+ *   (short only at EOF), or -1 on error.
+ */
+long
+fs_file_read(struct fs_file *f, void *buf, size_t len, long offset)
+{
+    size_t done = 0;
+    size_t lo, hi;
+
+    if (offset < 0) {
+        return -1;
+    }
+    if ((uint32_t)offset >= f->ino.size) {
+        return 0;
+    }
+    if (len > f->ino.size - (uint32_t)offset) {
+        len = f->ino.size - (uint32_t)offset;
+    }
+
+    /* Find the extent containing 'offset'. */
+    lo = 0;
+    hi = f->next;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (f->foffs[mid] <= offset) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    while (done < len && lo < f->next) {
+        const struct fs_extent *ext = &f->ext[lo];
+        long within = offset + (long)done - f->foffs[lo];
+        size_t chunk = ext->len - (size_t)within;
+
+        if (chunk > len - done) {
+            chunk = len - done;
+        }
+        if (ext->hole) {
+            memset((char *)buf + done, 0, chunk);
+        }
+        else if (fs_read_at(f->fs, ext->off + within,
+                            (char *)buf + done, chunk) != 0) {
+            return -1;
+        }
+        done += chunk;
+        lo++;
+    }
+    return (long)done;
+}
+
+void
+fs_close(struct fs_file *f)
+{
+    if (!f) {
+        return;
+    }
+    free(f->ext);
+    free(f->foffs);
+    free(f);
+}
+
+/*
+ * fs_read_file_range:
+ *   One-shot ranged read: 'len' bytes at byte 'off' of 'ino' into
+ *   'buf', touching only the covering zones.  Callers doing repeated
+ *   reads from one file should hold an fs_open handle instead, which
+ *   maps the extents once.  Returns bytes read or -1.
+ */
+long
+fs_read_file_range(const struct fs *fs, const struct inode *ino,
+                   long off, size_t len, void *buf)
+{
+    struct fs_file *f = file_from_inode(fs, ino);
+    long got;
+
+    if (!f) {
+        return -1;
+    }
+    got = fs_file_read(f, buf, len, off);
+    fs_close(f);
+    return got;
+}
+
+/*
+ * fs_crc32_file:
+ *   CRC-32 of a whole file without writing it anywhere (minls -c).
+ *   One extent map, then large positional reads through the copy
+ *   buffer size.  Returns 0 on success, -1 on error.
+ */
+int
+fs_crc32_file(const struct fs *fs, const struct inode *ino, uint32_t *crc)
+{
+    struct fs_file *f;
+    unsigned char *buf;
+    long off = 0;
+    int rc = 0;
+
+    *crc = 0;
+    f = file_from_inode(fs, ino);
+    if (!f) {
+        return -1;
+    }
+    buf = malloc(fs->copybuf_bytes);
+    if (!buf) {
+        fprintf(stderr, "malloc crc buffer\n");
+        fs_close(f);
+        return -1;
+    }
+    for (;;) {
+        long got = fs_file_read(f, buf, fs->copybuf_bytes, off);
+
+        if (got < 0) {
+            rc = -1;
+            break;
+        }
+        if (got == 0) {
+            break;
+        }
+        *crc = fs_crc32(*crc, buf, (size_t)got);
+        off += got;
+    }
+    free(buf);
+    fs_close(f);
+    return rc;
+}
+
+
+/* ----- Persistent path index sidecar ----- */
+
+/* Sidecar header.  The format is a host-local cache (host endianness
+ * and sizes); a mismatched or stale file simply fails validation and
+ * is ignored. */
+#define IDX_MAGIC "MINXIDX1"
+
+struct idx_header {
+    char magic[8];
+    long img_size;           /* st_size of the image when built */
+    long img_mtime;          /* st_mtime of the image when built */
+    long fs_offset;
+    uint32_t ninodes;
+    uint32_t zones;
+    uint32_t count;
+};
+
+/* Growable (path, inum) list used while building. */
+struct idx_pair {
+    char *path;
+    uint32_t inum;
+};
+
+struct idx_build {
+    struct idx_pair *v;
+    size_t n;
+    size_t cap;
+};
+
+static int
+idx_build_add(struct idx_build *b, const char *path, uint32_t inum)
+{
+    if (b->n == b->cap) {
+        void *tmp;
+        size_t ncap = b->cap ? b->cap * 2 : 256;
+
+        tmp = realloc(b->v, ncap * sizeof(*b->v));
+        if (!tmp) {
+            fprintf(stderr, "realloc index\n");
+            return -1;
+        }
+        b->v = tmp;
+        b->cap = ncap;
+    }
+    b->v[b->n].path = malloc(strlen(path) + 1);
+    if (!b->v[b->n].path) {
+        fprintf(stderr, "malloc index path\n");
+        return -1;
+    }
+    strcpy(b->v[b->n].path, path);
+    b->v[b->n].inum = inum;
+    b->n++;
+    return 0;
+}
+
+/* fs_walk_tree callback: record every entry's path and inode number. */
+static int
+idx_collect_cb(const struct fs *fs, const char *path,
+               const struct inode *ino, uint32_t inum, void *arg)
+{
+    (void)fs;
+    (void)ino;
+    return idx_build_add(arg, path, inum);
+}
+
+static int
+idx_cmp(const void *a, const void *b)
+{
+    const struct idx_pair *x = a;
+    const struct idx_pair *y = b;
+
+    return strcmp(x->path, y->path);
+}
+
+/*
+ * fs_index_build:
+ *   Walk the whole tree once, collect full-path -> inode pairs for
+ *   every entry, and write them sorted to "<imagefile>.minxidx"
+ *   together with enough image metadata to detect staleness.
+ */
+int
+fs_index_build(struct fs *fs, const char *imagefile)
+{
+    struct idx_build b;
+    struct idx_header hdr;
+    struct stat st;
+    char sidecar[1100];
+    FILE *out;
+    size_t i;
+    int rc = -1;
+
+    if (strlen(imagefile) + 9 > sizeof(sidecar)) {
+        fprintf(stderr, "image path too long for sidecar\n");
+        return -1;
+    }
+    sprintf(sidecar, "%s.minxidx", imagefile);
+
+    memset(&b, 0, sizeof(b));
+    if (fs_walk_tree(fs, idx_collect_cb, &b) < 0) {
+        goto done;
+    }
+
+    qsort(b.v, b.n, sizeof(*b.v), idx_cmp);
+
+    if (stat(imagefile, &st) != 0) {
+        perror("stat imagefile");
+        goto done;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IDX_MAGIC, 8);
+    hdr.img_size = (long)st.st_size;
+    hdr.img_mtime = (long)st.st_mtime;
+    hdr.fs_offset = fs->fs_offset;
+    hdr.ninodes = fs->sb.ninodes;
+    hdr.zones = fs->sb.zones;
+    hdr.count = (uint32_t)b.n;
+
+    out = fopen(sidecar, "wb");
+    if (!out) {
+        perror("fopen sidecar");
+        goto done;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1) {
+        perror("fwrite sidecar");
+        fclose(out);
+        goto done;
+    }
+    for (i = 0; i < b.n; i++) {
+        uint32_t len = (uint32_t)strlen(b.v[i].path);
+
+        if (fwrite(&b.v[i].inum, sizeof(uint32_t), 1, out) != 1 ||
+            fwrite(&len, sizeof(uint32_t), 1, out) != 1 ||
+            fwrite(b.v[i].path, 1, len, out) != len) {
+            perror("fwrite sidecar");
+            fclose(out);
+            goto done;
+        }
+    }
+    if (fclose(out) != 0) {
+        perror("fclose sidecar");
+        goto done;
+    }
+    rc = 0;
+
+done:
+    for (i = 0; i < b.n; i++) {
+        free(b.v[i].path);
+    }
+    free(b.v);
+    return rc;
+}
+
+/*
+ * fs_index_load:
+ *   Load "<imagefile>.minxidx" into fs->idx_* if it exists and still
+ *   matches the image (size, mtime, superblock identity).  Silent
+ *   best-effort: a missing or stale sidecar just means fs_find_path
+ *   keeps scanning directories.
+ */
+int
+fs_index_load(struct fs *fs, const char *imagefile)
+{
+    struct idx_header hdr;
+    struct stat st;
+    char sidecar[1100];
+    FILE *in;
+    uint32_t i;
+    size_t blob_used = 0, blob_cap;
+    long fsize;
+
+    if (strlen(imagefile) + 9 > sizeof(sidecar)) {
+        return -1;
+    }
+    sprintf(sidecar, "%s.minxidx", imagefile);
+
+    in = fopen(sidecar, "rb");
+    if (!in) {
+        return -1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+        memcmp(hdr.magic, IDX_MAGIC, 8) != 0 ||
+        stat(imagefile, &st) != 0 ||
+        hdr.img_size != (long)st.st_size ||
+        hdr.img_mtime != (long)st.st_mtime ||
+        hdr.fs_offset != fs->fs_offset ||
+        hdr.ninodes != fs->sb.ninodes ||
+        hdr.zones != fs->sb.zones) {
+        fclose(in);
+        return -1;
+    }
+
+    /* Size the path blob from the sidecar file size. */
+    if (fseek(in, 0, SEEK_END) != 0 || (fsize = ftell(in)) < 0 ||
+        fseek(in, (long)sizeof(hdr), SEEK_SET) != 0) {
+        fclose(in);
+        return -1;
+    }
+    blob_cap = (size_t)fsize + hdr.count;  /* + room for NULs */
+
+    fs->idx_paths = malloc(blob_cap);
+    fs->idx_offs = malloc(hdr.count * sizeof(uint32_t));
+    fs->idx_inums = malloc(hdr.count * sizeof(uint32_t));
+    if (!fs->idx_paths || !fs->idx_offs || !fs->idx_inums) {
+        fprintf(stderr, "malloc index\n");
+        goto fail;
+    }
+
+    for (i = 0; i < hdr.count; i++) {
+        uint32_t inum, len;
+
+        if (fread(&inum, sizeof(uint32_t), 1, in) != 1 ||
+            fread(&len, sizeof(uint32_t), 1, in) != 1 ||
+            blob_used + len + 1 > blob_cap ||
+            fread(fs->idx_paths + blob_used, 1, len, in) != len) {
+            goto fail;
+        }
+        fs->idx_paths[blob_used + len] = '\0';
+        fs->idx_offs[i] = (uint32_t)blob_used;
+        fs->idx_inums[i] = inum;
+        blob_used += len + 1;
+    }
+    fclose(in);
+    fs->idx_count = hdr.count;
+    return 0;
+
+fail:
+    fclose(in);
+    free(fs->idx_paths);
+    free(fs->idx_offs);
+    free(fs->idx_inums);
+    fs->idx_paths = NULL;
+    fs->idx_offs = NULL;
+    fs->idx_inums = NULL;
+    fs->idx_count = 0;
+    return -1;
 }
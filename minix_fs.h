@@ -103,16 +103,111 @@ struct options {
    int have_subpartition;
    int part;
    int subpart;
+   int cache_mb;     /* -C: zone cache size in MB (0 disables) */
+   int copybuf_mb;   /* -w: copy buffer size in MB */
+   char *batchfile;  /* -B: minget batch mode list of source paths */
+   int extract_all;  /* -a: minget extracts the whole tree */
+   int jobs;         /* -j: worker threads for batch mode */
+   int recursive;    /* -R: minls recursive listing */
+   int build_index;  /* -x: (re)build the path index sidecar */
+   int show_stats;   /* -S: dump I/O statistics at exit */
+   long range_off;   /* -o: minget ranged read start (-1 = unset) */
+   long range_len;   /* -l: minget ranged read length (-1 = to EOF) */
+   int checksum;     /* -c: emit per-file CRC-32 checksums */
+   char *multi;      /* -M: path to look up across several images */
+   int quick;        /* -q: minimal-footprint single-path stat */
+   int usage_report; /* -U: bitmap allocation report */
+   int tar;          /* -t: minget streams a tar archive to stdout */
+   char *glob;       /* -g: list only names matching this pattern */
 };
 
 
+/* Counters for the hot paths, dumped by -S.  Maintained on every
+ * read regardless of the flag; the increments are too cheap to gate. */
+struct fs_stats {
+   unsigned long reads;           /* raw pread/fread calls */
+   unsigned long bytes_read;      /* bytes those reads returned */
+   unsigned long cache_hits;      /* zone cache */
+   unsigned long cache_misses;
+   unsigned long zones_visited;   /* directory zones walked */
+   unsigned long dirents_scanned; /* entries examined in those zones */
+   unsigned long inode_loads;     /* fs_get_inode calls */
+   unsigned long index_hits;      /* lookups served by the path index */
+};
+
+
+/* One slot of the zone-granular read cache. */
+struct fs_cache_slot {
+   long   off;              /* absolute chunk offset, -1 = empty */
+   size_t valid;            /* bytes of data[] that are valid */
+   unsigned long stamp;     /* LRU stamp */
+   unsigned char *data;     /* zonesize bytes, allocated lazily */
+};
+
+
+/* Opaque per-directory lookup hash table (see minix_fs.c). */
+struct fs_dirhash;
+
+/* Opaque resolved-prefix cache (see minix_fs.c). */
+struct fs_pcache;
+
+
 /* Represents the filesystem context (computed once) */
 struct fs {
    FILE *fp;
+   int   fd;             /* image descriptor; all raw reads use pread */
    long  fs_offset;      /* byte offset of start of filesystem within image */
+   uint32_t copybuf_bytes;  /* copy engine buffer size (-w) */
    struct superblock sb;
    uint32_t blocksize;
    uint32_t zonesize;
+
+   /* mmap backend: non-NULL if the whole image is mapped read-only.
+    * All reads then come straight out of the mapping instead of
+    * paying an fseek+fread pair per structure. */
+   const unsigned char *map;
+   size_t map_size;
+
+   /* Zone-granular LRU read cache, used when the image is not mapped.
+    * Repeated lookups over the same directories and indirect blocks
+    * then hit memory instead of going back to disk. */
+   struct fs_cache_slot *cache;
+   uint32_t cache_slots;
+   unsigned long cache_tick;
+
+   /* Loaded path-index sidecar: sorted full paths -> inode numbers.
+    * fs_find_path binary-searches this instead of scanning
+    * directories when it is present. */
+   char     *idx_paths;     /* concatenated NUL-terminated paths */
+   uint32_t *idx_offs;      /* offset of each path in idx_paths */
+   uint32_t *idx_inums;
+   uint32_t  idx_count;
+
+   /* Inode-table slab cache: whole blocksize-sized pieces of the
+    * inode table, loaded on first touch (or all at once by
+    * fs_load_inode_table).  Unused when the image is mapped. */
+   unsigned char **islabs;
+   uint32_t islab_count;
+
+   /* Allocation bitmaps, loaded on demand by fs_load_bitmaps (and
+    * NULL until then).  Once present, the zone bitmap doubles as a
+    * hole oracle for the extent mapper. */
+   unsigned char *imap;
+   unsigned char *zmap;
+
+   /* Per-directory name hashes, built on first lookup into large
+    * directories so repeated lookups stop rescanning every dirent.
+    * Opaque; managed entirely inside minix_fs.c. */
+   struct fs_dirhash *dirhash;
+
+   /* Resolved directory-prefix cache: canonical prefix -> inode
+    * number, so paths sharing a prefix walk it only once per
+    * process.  Opaque; managed entirely inside minix_fs.c. */
+   struct fs_pcache *pcache;
+
+   /* Hot-path counters (see struct fs_stats).  Approximate under
+    * multi-threaded batch runs; exact otherwise. */
+   struct fs_stats stats;
 };
 
 
@@ -125,15 +220,34 @@ int parse_common_options(int argc, char **argv,
 
 /* Filesystem helpers */
 int   fs_init(struct fs *fs, FILE *fp, const struct options *opt, int verbose);
+void  fs_destroy(struct fs *fs);
+int   fs_read_at(const struct fs *fs, long off, void *buf, size_t len);
+const void *fs_data_ptr(const struct fs *fs, long off, size_t len);
 int   fs_read_super(struct fs *fs, int verbose);
 int   fs_get_inode(const struct fs *fs, uint32_t inum, struct inode *ino);
+int   fs_load_inode_table(struct fs *fs);
 int   fs_find_path(const struct fs *fs, const char *path, struct inode *ino,
                   uint32_t *inum);
+int   fs_load_bitmaps(struct fs *fs);
+int   fs_zone_allocated(const struct fs *fs, uint32_t zone);
+void  fs_print_usage(const struct fs *fs);
+void  fs_set_name_filter(const char *pattern);
 int   fs_list_dir(const struct fs *fs, const char *path,
                  const struct inode *dir_ino);
+int   fs_list_tree(const struct fs *fs, const char *path,
+                  const struct inode *dir_ino);
+
+/* Tree walk callback: full path from the root, the entry's inode and
+ * inode number.  Return 0 to continue, negative to abort the walk. */
+typedef int (*fs_walk_fn)(const struct fs *fs, const char *path,
+                          const struct inode *ino, uint32_t inum,
+                          void *arg);
+
+int   fs_walk_tree(const struct fs *fs, fs_walk_fn cb, void *arg);
 int   fs_is_dir(const struct inode *ino);
 int   fs_is_regular(const struct inode *ino);
 void  fs_print_inode_verbose(const struct inode *ino);
+void  fs_print_stats(const struct fs *fs);
 void  fs_perm_string(const struct inode *ino, char *out);
 
 
@@ -144,7 +258,64 @@ void  canonicalize_path(const char *in, char *out, size_t outsz);
 
 
 
-/* For minget */
+/* ----- Extent mapping ----- */
+
+/* One maximal run of file bytes that is contiguous on disk.
+ * Hole runs have hole != 0 and no meaningful offset. */
+struct fs_extent {
+   long     off;      /* absolute byte offset in the image */
+   uint32_t len;      /* run length in bytes */
+   int      hole;     /* nonzero: unallocated (reads as zeros) */
+};
+
+/* Extent callback: return 0 to continue, negative to abort the walk. */
+typedef int (*fs_extent_fn)(const struct fs *fs,
+                            const struct fs_extent *ext,
+                            void *arg);
+
+int fs_map_extents(const struct fs *fs, int fd, const struct inode *ino,
+                   fs_extent_fn cb, void *arg);
+
+
+/* Path index sidecar ("<image>.minxidx"): full-path -> inode map
+ * built in one tree walk and reused across runs on immutable images. */
+int fs_index_build(struct fs *fs, const char *imagefile);
+int fs_index_load(struct fs *fs, const char *imagefile);
+
+
+/* Open-file handle for random access: the layer a mount frontend
+ * sits on.  fs_open resolves the path once and caches the extent
+ * map, so each fs_file_read touches only the zones covering the
+ * requested range instead of streaming from offset zero. */
+struct fs_file {
+   const struct fs *fs;
+   struct inode ino;
+   struct fs_extent *ext;   /* extent map, in file order */
+   long  *foffs;            /* file offset where each extent starts */
+   size_t next;             /* number of extents */
+};
+
+struct fs_file *fs_open(const struct fs *fs, const char *path);
+long fs_file_read(struct fs_file *f, void *buf, size_t len, long offset);
+void fs_close(struct fs_file *f);
+long fs_read_file_range(const struct fs *fs, const struct inode *ino,
+                        long off, size_t len, void *buf);
+
+
+/* Checksums: zlib-compatible CRC-32.  fs_copy_file_crc accumulates
+ * it inline during extraction; fs_crc32_file reads without output. */
+uint32_t fs_crc32(uint32_t crc, const void *buf, size_t len);
+int fs_crc32_file(const struct fs *fs, const struct inode *ino,
+                  uint32_t *crc);
+
+
+/* File copying.  fs_copy_file takes an optional per-thread image
+ * descriptor (fd, or -1) so batch workers can read concurrently;
+ * fs_copy_file_to_stream is the simple single-threaded form. */
+int fs_copy_file(const struct fs *fs, int fd, const struct inode *ino,
+                 FILE *out);
+int fs_copy_file_crc(const struct fs *fs, int fd, const struct inode *ino,
+                     FILE *out, uint32_t *crc);
 int fs_copy_file_to_stream(const struct fs *fs,
                           const struct inode *ino,
                           FILE *out);
@@ -0,0 +1,282 @@
+/*
+ * minixd.c
+ *   Resident server for a MINIX filesystem image.  Opens the image
+ *   once via fs_init, keeps the caches warm, and answers requests
+ *   over a Unix-domain socket so clients do not pay process startup
+ *   and image open costs per request.
+ *
+ *   Protocol: one request line per connection, then the response and
+ *   close.  Requests:
+ *       LIST <path>                    directory listing, minls format
+ *       STAT <path>                    one "perms size path" line
+ *       GET <path>                     raw file contents
+ *       READ <path> <offset> <length>  ranged read from mid-file
+ *   Errors come back as a single "ERR: <message>" line.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "minix_fs.h"
+
+
+/*
+ * send_line:
+ *   Write one text line to the client socket.  Best effort; the
+ *   client may already be gone (SIGPIPE is ignored).
+ */
+static void
+send_line(int cfd, const char *msg)
+{
+    write(cfd, msg, strlen(msg));
+    write(cfd, "\n", 1);
+}
+
+
+/*
+ * read_request:
+ *   Read the request line from the client into buf, stripping the
+ *   trailing newline.  Returns 0 on success, -1 on error/overlong.
+ */
+static int
+read_request(int cfd, char *buf, size_t bufsz)
+{
+    size_t used = 0;
+
+    while (used + 1 < bufsz) {
+        ssize_t n = read(cfd, buf + used, 1);
+
+        if (n <= 0) {
+            return -1;
+        }
+        if (buf[used] == '\n') {
+            buf[used] = '\0';
+            return 0;
+        }
+        used++;
+    }
+    return -1;
+}
+
+
+/*
+ * serve_request:
+ *   Parse and answer one request on a connected client socket.
+ *   Listing output reuses fs_list_dir by pointing stdout at the
+ *   client for the duration of the request (single-threaded loop,
+ *   so this is safe); saved_out restores it afterwards.
+ */
+static void
+serve_request(const struct fs *fs, int cfd, int saved_out, int verbose)
+{
+    char line[1024];
+    char canon[1024];
+    char perm[11];
+    struct inode ino;
+    uint32_t inum;
+    char *cmd;
+    char *path;
+
+    if (read_request(cfd, line, sizeof(line)) < 0) {
+        send_line(cfd, "ERR: bad request");
+        return;
+    }
+
+    cmd = line;
+    path = strchr(line, ' ');
+    if (!path) {
+        send_line(cfd, "ERR: usage: LIST|STAT|GET|READ <path>");
+        return;
+    }
+    *path++ = '\0';
+
+    if (verbose) {
+        fprintf(stderr, "minixd: %s %s\n", cmd, path);
+    }
+
+    if (strcmp(cmd, "READ") == 0) {
+        /* Ranged read: READ <path> <offset> <length>. */
+        char pbuf[1024];
+        long roff;
+        unsigned long rlen;
+        struct fs_file *file;
+        unsigned char *data;
+        long got;
+
+        if (sscanf(path, "%1023s %ld %lu", pbuf, &roff, &rlen) != 3) {
+            send_line(cfd, "ERR: usage: READ <path> <offset> <length>");
+            return;
+        }
+        if (rlen > 16UL * 1024 * 1024) {
+            rlen = 16UL * 1024 * 1024;   /* per-request cap */
+        }
+        file = fs_open(fs, pbuf);
+        if (!file) {
+            send_line(cfd, "ERR: not found");
+            return;
+        }
+        data = malloc(rlen ? rlen : 1);
+        if (!data) {
+            send_line(cfd, "ERR: internal error");
+            fs_close(file);
+            return;
+        }
+        got = fs_file_read(file, data, rlen, roff);
+        if (got < 0) {
+            send_line(cfd, "ERR: read failed");
+        }
+        else {
+            long sent = 0;
+
+            while (sent < got) {
+                ssize_t n = write(cfd, data + sent, got - sent);
+
+                if (n <= 0) {
+                    break;
+                }
+                sent += n;
+            }
+        }
+        free(data);
+        fs_close(file);
+        return;
+    }
+
+    if (fs_find_path(fs, path, &ino, &inum) < 0) {
+        send_line(cfd, "ERR: not found");
+        return;
+    }
+    canonicalize_path(path, canon, sizeof(canon));
+
+    if (strcmp(cmd, "GET") == 0) {
+        FILE *out;
+        int dupfd;
+
+        if (!fs_is_regular(&ino)) {
+            send_line(cfd, "ERR: not a regular file");
+            return;
+        }
+        dupfd = dup(cfd);
+        if (dupfd < 0 || (out = fdopen(dupfd, "wb")) == NULL) {
+            send_line(cfd, "ERR: internal error");
+            return;
+        }
+        fs_copy_file_to_stream(fs, &ino, out);
+        fclose(out);
+    }
+    else if (strcmp(cmd, "STAT") == 0) {
+        char reply[1100];
+
+        fs_perm_string(&ino, perm);
+        sprintf(reply, "%s %9u %s", perm, (unsigned int)ino.size, canon);
+        send_line(cfd, reply);
+    }
+    else if (strcmp(cmd, "LIST") == 0) {
+        if (!fs_is_dir(&ino)) {
+            send_line(cfd, "ERR: not a directory");
+            return;
+        }
+        fflush(stdout);
+        dup2(cfd, STDOUT_FILENO);
+        printf("%s:\n", canon);
+        fs_list_dir(fs, canon, &ino);
+        fflush(stdout);
+        dup2(saved_out, STDOUT_FILENO);
+    }
+    else {
+        send_line(cfd, "ERR: unknown command");
+    }
+}
+
+
+int
+main(int argc, char **argv)
+{
+    struct options opt;
+    struct fs fs;
+    char **rest;
+    char *imagefile;
+    char *sockpath;
+    FILE *fp;
+    int sfd;
+    int saved_out;
+    struct sockaddr_un addr;
+
+    parse_common_options(argc, argv, &opt, 0, &rest);
+
+    if (rest[0] == NULL || rest[1] == NULL) {
+        fprintf(stderr,
+            "usage: minixd [ -v ] [ -p num [ -s num ] ] "
+            "imagefile socketpath\n");
+        exit(EXIT_FAILURE);
+    }
+    imagefile = rest[0];
+    sockpath = rest[1];
+
+    fp = fopen(imagefile, "rb");
+    if (!fp) {
+        perror("fopen imagefile");
+        exit(EXIT_FAILURE);
+    }
+
+    if (fs_init(&fs, fp, &opt, opt.verbose) < 0) {
+        fs_destroy(&fs);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Warm everything we can before taking traffic. */
+    fs_index_load(&fs, imagefile);
+    fs_load_inode_table(&fs);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sfd < 0) {
+        perror("socket");
+        fs_destroy(&fs);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sockpath, sizeof(addr.sun_path) - 1);
+    unlink(sockpath);
+    if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(sfd, 16) < 0) {
+        perror("bind/listen");
+        close(sfd);
+        fs_destroy(&fs);
+        exit(EXIT_FAILURE);
+    }
+
+    if (opt.verbose) {
+        fprintf(stderr, "minixd: serving %s on %s\n", imagefile, sockpath);
+    }
+
+    saved_out = dup(STDOUT_FILENO);
+    for (;;) {
+        int cfd = accept(sfd, NULL, NULL);
+
+        if (cfd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+        serve_request(&fs, cfd, saved_out, opt.verbose);
+        close(cfd);
+    }
+
+    close(sfd);
+    unlink(sockpath);
+    fs_destroy(&fs);
+    return 0;
+}
@@ -4,11 +4,196 @@
  *   from a MINIX filesystem image using the shared minix_fs.c helpers.
  */
 
+#define _XOPEN_SOURCE 600   /* for fdopen with -ansi */
+#ifdef __linux__
+#define _GNU_SOURCE         /* O_NOATIME for -q probes */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "minix_fs.h"
 
+
+/* Shared state for the -M multi-image sweep.  Workers claim images
+ * off a shared cursor; matches print as they are found. */
+struct sweep_pool {
+    const struct options *opt;
+    const char *path;        /* path to look up in every image */
+    char **images;
+    int nimages;
+    int next;                /* next unclaimed image */
+    int found;               /* images where the path resolved */
+    int failed;              /* images that could not be opened */
+    pthread_mutex_t lock;
+};
+
+/*
+ * sweep_one:
+ *   Look up the pool's path in one image with a private fs context.
+ *   A match prints "image: perm size path" immediately; open or
+ *   superblock failures are reported and counted but do not stop the
+ *   sweep.
+ */
+static void
+sweep_one(struct sweep_pool *pool, const char *image)
+{
+    struct fs fs;
+    FILE *fp;
+    struct inode ino;
+    uint32_t inum = 0;
+    char perm[11];
+    char canon[1024];
+
+    fp = fopen(image, "rb");
+    if (!fp) {
+        fprintf(stderr, "%s: cannot open\n", image);
+        pthread_mutex_lock(&pool->lock);
+        pool->failed++;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    if (fs_init(&fs, fp, pool->opt, 0) < 0) {
+        fprintf(stderr, "%s: not a usable image\n", image);
+        fs_destroy(&fs);
+        pthread_mutex_lock(&pool->lock);
+        pool->failed++;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    fs_index_load(&fs, image);
+
+    if (fs_find_path(&fs, pool->path, &ino, &inum) == 0) {
+        canonicalize_path(pool->path, canon, sizeof(canon));
+        fs_perm_string(&ino, perm);
+        printf("%s: %s %9u %s\n",
+               image, perm, (unsigned int)ino.size, canon);
+        pthread_mutex_lock(&pool->lock);
+        pool->found++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    else if (pool->opt->verbose) {
+        fprintf(stderr, "%s: no match\n", image);
+    }
+    fs_destroy(&fs);
+}
+
+static void *
+sweep_worker(void *arg)
+{
+    struct sweep_pool *pool = arg;
+
+    for (;;) {
+        int i;
+
+        pthread_mutex_lock(&pool->lock);
+        i = pool->next;
+        if (i < pool->nimages) {
+            pool->next++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->nimages) {
+            break;
+        }
+        sweep_one(pool, pool->images[i]);
+    }
+    return NULL;
+}
+
+/*
+ * sweep_images:
+ *   -M mode: look up one path in every listed image, -j workers at a
+ *   time.  Each worker opens its own fs context, so images are probed
+ *   fully concurrently.  Exits 0 if the path resolved in at least one
+ *   image, 1 otherwise.
+ */
+static int
+sweep_images(const struct options *opt, char **images, int nimages)
+{
+    struct sweep_pool pool;
+    int jobs = opt->jobs;
+
+    pool.opt = opt;
+    pool.path = opt->multi;
+    pool.images = images;
+    pool.nimages = nimages;
+    pool.next = 0;
+    pool.found = 0;
+    pool.failed = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    if (jobs > nimages) {
+        jobs = nimages;
+    }
+    if (jobs > 1) {
+        pthread_t *tids;
+        int t;
+
+        tids = malloc(jobs * sizeof(*tids));
+        if (!tids) {
+            fprintf(stderr, "malloc thread ids\n");
+            jobs = 1;
+        }
+        if (jobs > 1) {
+            for (t = 0; t < jobs; t++) {
+                if (pthread_create(&tids[t], NULL,
+                                   sweep_worker, &pool) != 0) {
+                    perror("pthread_create");
+                    break;
+                }
+            }
+            while (--t >= 0) {
+                pthread_join(tids[t], NULL);
+            }
+            free(tids);
+        }
+    }
+    if (jobs <= 1) {
+        sweep_worker(&pool);
+    }
+
+    pthread_mutex_destroy(&pool.lock);
+    return pool.found > 0 ? 0 : 1;
+}
+
+
+/*
+ * checksum_cb:
+ *   fs_walk_tree callback for -c: print a CRC-32 line for every
+ *   regular file whose path lies under the requested prefix ("/"
+ *   matches everything).  Output matches the classic cksum-style
+ *   "crc32 <hex> <path>" form so it can be diffed between images.
+ */
+static int
+checksum_cb(const struct fs *fs, const char *path,
+            const struct inode *ino, uint32_t inum, void *arg)
+{
+    const char *prefix = arg;
+    size_t plen = strlen(prefix);
+    uint32_t crc;
+
+    (void)inum;
+    if (!fs_is_regular(ino)) {
+        return 0;
+    }
+    if (strcmp(prefix, "/") != 0) {
+        if (strncmp(path, prefix, plen) != 0 ||
+            (path[plen] != '/' && path[plen] != '\0')) {
+            return 0;
+        }
+    }
+    if (fs_crc32_file(fs, ino, &crc) < 0) {
+        fprintf(stderr, "crc32 failed for %s\n", path);
+        return 0;
+    }
+    printf("crc32 %08x %s\n", (unsigned int)crc, path);
+    return 0;
+}
+
+
 int
 main(int argc, char **argv)
 {
@@ -29,6 +214,22 @@ main(int argc, char **argv)
    parse_common_options(argc, argv, &opt, 0, &rest);
 
 
+   if (opt.multi) {
+       /* Multi-image sweep: every remaining argument is an image. */
+       int nimages = 0;
+
+       while (rest[nimages] != NULL) {
+           nimages++;
+       }
+       if (nimages == 0) {
+           fprintf(stderr,
+               "usage: minls [ -j n ] -M path imagefile ...\n");
+           exit(EXIT_FAILURE);
+       }
+       return sweep_images(&opt, rest, nimages);
+   }
+
+
    if (rest[0] == NULL) {
        fprintf(stderr,
            "usage: minls [ -v ] [ -p num [ -s num ] ] imagefile [ path ]\n");
@@ -45,6 +246,57 @@ main(int argc, char **argv)
    }
 
 
+   if (opt.usage_report) {
+       /* Allocation report (-U): just the bitmaps, no lookup. */
+       fp = fopen(imagefile, "rb");
+       if (!fp) {
+           perror("fopen imagefile");
+           exit(EXIT_FAILURE);
+       }
+       if (fs_init(&fs, fp, &opt, opt.verbose) < 0 ||
+           fs_load_bitmaps(&fs) < 0) {
+           fs_destroy(&fs);
+           exit(EXIT_FAILURE);
+       }
+       fs_print_usage(&fs);
+       fs_destroy(&fs);
+       return 0;
+   }
+
+
+   if (opt.quick) {
+       /* Fast-stat probe (-q): resolve one path with the bare
+        * minimum of reads.  fs_init skips the mapping and caches;
+        * O_NOATIME (where available and permitted) keeps the probe
+        * from dirtying inode atimes on the host. */
+       int fd = -1;
+
+#ifdef O_NOATIME
+       fd = open(imagefile, O_RDONLY | O_NOATIME);
+#endif
+       if (fd < 0) {
+           fd = open(imagefile, O_RDONLY);
+       }
+       if (fd < 0 || (fp = fdopen(fd, "rb")) == NULL) {
+           perror("open imagefile");
+           exit(EXIT_FAILURE);
+       }
+       if (fs_init(&fs, fp, &opt, 0) < 0) {
+           fs_destroy(&fs);
+           exit(EXIT_FAILURE);
+       }
+       if (fs_find_path(&fs, path, &ino, &inum) < 0) {
+           fs_destroy(&fs);
+           exit(EXIT_FAILURE);
+       }
+       canonicalize_path(path, canon, sizeof(canon));
+       fs_perm_string(&ino, perm);
+       printf("%s %9u %s\n", perm, (unsigned int)ino.size, canon);
+       fs_destroy(&fs);
+       return 0;
+   }
+
+
    fp = fopen(imagefile, "rb");
    if (!fp) {
        perror("fopen imagefile");
@@ -53,13 +305,22 @@ main(int argc, char **argv)
 
 
    if (fs_init(&fs, fp, &opt, opt.verbose) < 0) {
-       fclose(fp);
+       fs_destroy(&fs);
        exit(EXIT_FAILURE);
    }
 
 
+   if (opt.build_index) {
+       if (fs_index_build(&fs, imagefile) < 0) {
+           fs_destroy(&fs);
+           exit(EXIT_FAILURE);
+       }
+   }
+   fs_index_load(&fs, imagefile);
+
+
    if (fs_find_path(&fs, path, &ino, &inum) < 0) {
-       fclose(fp);
+       fs_destroy(&fs);
        exit(EXIT_FAILURE);
    }
 
@@ -78,14 +339,42 @@ main(int argc, char **argv)
         fs_print_inode_verbose(&ino);
     }
 
-    if (fs_is_dir(&ino)) {
+    if (opt.glob) {
+        fs_set_name_filter(opt.glob);
+    }
+
+    if (opt.checksum) {
+        /* Checksum mode replaces the listing entirely. */
+        if (fs_is_dir(&ino)) {
+            fs_load_inode_table(&fs);
+            fs_walk_tree(&fs, checksum_cb, canon);
+        }
+        else {
+            uint32_t crc;
+
+            if (fs_crc32_file(&fs, &ino, &crc) < 0) {
+                fs_destroy(&fs);
+                exit(EXIT_FAILURE);
+            }
+            printf("crc32 %08x %s\n", (unsigned int)crc, canon);
+        }
+    }
+    else if (fs_is_dir(&ino)) {
         /*
          * Directories: header should include the leading '/'.
          * e.g., "/Files:", "/DeepPaths/...:", "/Deleted:".
          */
-        printf("%s:\n", canon);
-        fs_list_dir(&fs, canon, &ino); 
-    } 
+        if (opt.recursive) {
+            /* A tree walk touches inodes all over the table; pull
+             * the whole table in up front. */
+            fs_load_inode_table(&fs);
+            fs_list_tree(&fs, canon, &ino);
+        }
+        else {
+            printf("%s:\n", canon);
+            fs_list_dir(&fs, canon, &ino);
+        }
+    }
     else {
         /* Single file listing: keep your original printpath behavior. */
         fs_perm_string(&ino, perm);
@@ -95,6 +384,9 @@ main(int argc, char **argv)
                printpath);
     }
 
-    fclose(fp);
+    if (opt.show_stats) {
+        fs_print_stats(&fs);
+    }
+    fs_destroy(&fs);
     return 0;
 }